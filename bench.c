@@ -0,0 +1,342 @@
+/*
+ * Throughput of the terminal on its own, no X and no shell: each workload is
+ * fed to a fresh 80x24 terminal with term_feed() until enough time has gone
+ * by, and we report MB/s, ns per byte and how many allocations one pass over
+ * it made.
+ *
+ * The workloads are generated, always the same; recorded ones can be given as
+ * files - st -o file logs everything the shell writes, ready to be replayed
+ * here.
+ */
+
+#include <getopt.h>
+#include <time.h>
+
+#include "term.h"
+
+#define BENCH_SIZE	(4 << 20)
+
+/* Allocations: linked with --wrap, so we see what term.o does */
+static unsigned long nallocs;
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+
+void *__wrap_malloc(size_t size)
+{
+	nallocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	nallocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+	nallocs++;
+	return __real_realloc(p, size);
+}
+
+struct buf {
+	char		*p;
+	size_t		len, size;
+};
+
+static void __attribute__((format(printf, 2, 3)))
+bprintf(struct buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	while (1) {
+		va_start(ap, fmt);
+		n = vsnprintf(b->p + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+
+		if (b->len + n < b->size)
+			break;
+
+		b->size = max(b->size * 2, b->len + n + 1);
+		b->p = xrealloc(b->p, b->size);
+	}
+
+	b->len += n;
+}
+
+/* Same numbers every run, so runs compare */
+static unsigned long seed;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (seed >> 33) % n;
+}
+
+static const char *words[] = {
+	"the", "terminal", "static", "void", "return", "struct", "include",
+	"unsigned", "if", "for", "while", "x", "y", "buf", "len", "of", "a",
+	"error", "warning", "note", "make", "build", "--", "0x7f", "(", ");",
+};
+
+static void word(struct buf *b)
+{
+	bprintf(b, "%s", words[rnd(ARRAY_SIZE(words))]);
+}
+
+/* cat of some source file */
+static void gen_ascii(struct buf *b)
+{
+	while (b->len < BENCH_SIZE) {
+		unsigned indent = rnd(4), width = 8 * indent;
+
+		bprintf(b, "%.*s", indent, "\t\t\t\t");
+		while (width < 60 + rnd(16)) {
+			size_t len = b->len;
+
+			word(b);
+			bprintf(b, " ");
+			width += b->len - len;
+		}
+		bprintf(b, "\r\n");
+	}
+}
+
+/* ls --color, and compiler errors */
+static void gen_sgr(struct buf *b)
+{
+	static const char *colors[] = {
+		"01;34", "01;32", "01;36", "40;33;01", "01;35", "0", "01;31",
+	};
+
+	while (b->len < BENCH_SIZE) {
+		unsigned i;
+
+		for (i = 0; i < 5; i++) {
+			bprintf(b, "\033[0m\033[%sm", colors[rnd(ARRAY_SIZE(colors))]);
+			word(b);
+			bprintf(b, ".%c\033[0m  ", 'a' + rnd(26));
+		}
+		bprintf(b, "\r\n");
+
+		if (!rnd(4))
+			bprintf(b, "\033[01m\033[Kterm.c:%u:%u:\033[m\033[K "
+				"\033[01;31m\033[Kerror: \033[m\033[K"
+				"'\033[01m\033[K%s\033[m\033[K' undeclared\r\n"
+				"\033[38;2;%u;%u;%um  %u | \033[m\t%s(x);\r\n",
+				rnd(3000), rnd(80), words[rnd(ARRAY_SIZE(words))],
+				rnd(256), rnd(256), rnd(256), rnd(3000),
+				words[rnd(ARRAY_SIZE(words))]);
+	}
+}
+
+/* htop/vim style: the whole screen redrawn with cursor addressing */
+static void gen_redraw(struct buf *b)
+{
+	while (b->len < BENCH_SIZE) {
+		unsigned y, x, bar;
+
+		bprintf(b, "\033[?25l\033[H");
+		for (y = 1; y <= 24; y++) {
+			bar = rnd(40);
+			bprintf(b, "\033[%u;1H\033[1;37;44m%3u\033[0m [", y, y);
+			for (x = 0; x < bar; x++)
+				bprintf(b, "\033[38;5;%um|", 16 + x * 6);
+			bprintf(b, "\033[0m\033[%uC]\033[1;32m%5.1f%%\033[0m\033[K",
+				40 - bar, bar * 2.5);
+		}
+		bprintf(b, "\033[24;1H\033[7m F1Help F2Setup \033[0m\033[?25h");
+	}
+}
+
+/* output scrolling inside a scroll region, with lines inserted and deleted */
+static void gen_scroll(struct buf *b)
+{
+	while (b->len < BENCH_SIZE) {
+		unsigned i;
+
+		bprintf(b, "\033[3;22r\033[22;1H");
+		for (i = 0; i < 40; i++) {
+			bprintf(b, "\n\r");
+			word(b);
+			bprintf(b, " %u", i);
+		}
+		bprintf(b, "\033[3;1H\033M\033M\033[%uL\033[%uM\033[5S\033[3T",
+			1 + rnd(5), 1 + rnd(5));
+		bprintf(b, "\033[r\033[24;1H\n");
+	}
+}
+
+/* CJK text, 3 byte UTF-8 */
+static void gen_cjk(struct buf *b)
+{
+	while (b->len < BENCH_SIZE) {
+		unsigned i, c;
+
+		for (i = 0; i < 70; i++) {
+			c = rnd(8) ? 0x4e00 + rnd(0x5000) : ' ';
+			if (c < 0x80)
+				bprintf(b, "%c", c);
+			else
+				bprintf(b, "%c%c%c", 0xe0 | (c >> 12),
+					0x80 | ((c >> 6) & 0x3f),
+					0x80 | (c & 0x3f));
+		}
+		bprintf(b, "\r\n");
+	}
+}
+
+/* titles and palette changes: long OSC strings */
+static void gen_osc(struct buf *b)
+{
+	while (b->len < BENCH_SIZE) {
+		unsigned i, len = rnd(2048);
+
+		bprintf(b, "\033]0;");
+		for (i = 0; i < len; i++)
+			bprintf(b, "%c", 'a' + rnd(26));
+		bprintf(b, "\007\033]4;%u;rgb:%02x/%02x/%02x\033\\",
+			rnd(256), rnd(256), rnd(256), rnd(256));
+		do {
+			word(b);
+			bprintf(b, "\r\n");
+		} while (rnd(2));
+	}
+}
+
+struct workload {
+	const char	*name;
+	void		(*gen)(struct buf *);
+};
+
+static struct workload workloads[] = {
+	{ "ascii",	gen_ascii },
+	{ "sgr",	gen_sgr },
+	{ "redraw",	gen_redraw },
+	{ "scroll",	gen_scroll },
+	{ "cjk",	gen_cjk },
+	{ "osc",	gen_osc },
+};
+
+/* Palette changes damage everything, as they would in st */
+static int setcolorname(struct st_term *term, int i, const char *name)
+{
+	return 1;
+}
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void bench(const char *name, struct buf *data, double seconds,
+		  bool json)
+{
+	static struct st_term term;
+	unsigned long runs = 0, allocs;
+	double start, elapsed;
+
+	memset(&term, 0, sizeof(term));
+	term_init(&term, 80, 24, 7, 0, 256, 10000);
+	term.setcolorname = setcolorname;
+
+	/* warm up: scrollback filled, buffers grown */
+	term_feed(&term, data->p, data->len);
+	term.out.len = 0;
+
+	nallocs = 0;
+	start = now();
+	do {
+		term_feed(&term, data->p, data->len);
+		/* nobody reads the replies */
+		term.out.len = 0;
+		runs++;
+		elapsed = now() - start;
+	} while (elapsed < seconds);
+	allocs = nallocs;
+
+	if (json)
+		printf("{\"name\": \"%s\", \"bytes\": %zu, \"runs\": %lu, "
+		       "\"mb_per_s\": %.2f, \"ns_per_byte\": %.3f, "
+		       "\"allocs_per_run\": %.1f}\n",
+		       name, data->len, runs,
+		       data->len * runs / elapsed / 1e6,
+		       elapsed * 1e9 / (data->len * runs),
+		       (double) allocs / runs);
+	else
+		printf("%-12s %6.1f MB %8.1f MB/s %8.3f ns/byte %8.1f allocs/run\n",
+		       name, data->len / 1e6,
+		       data->len * runs / elapsed / 1e6,
+		       elapsed * 1e9 / (data->len * runs),
+		       (double) allocs / runs);
+
+	term_free(&term);
+}
+
+static struct buf readfile(const char *path)
+{
+	struct buf b = { 0 };
+	FILE *f = fopen(path, "r");
+	size_t n;
+
+	if (!f)
+		edie("Couldn't open %s", path);
+
+	do {
+		if (b.len == b.size) {
+			b.size = b.size ? b.size * 2 : BUFSIZ;
+			b.p = xrealloc(b.p, b.size);
+		}
+		n = fread(b.p + b.len, 1, b.size - b.len, f);
+		b.len += n;
+	} while (n);
+
+	if (ferror(f))
+		edie("Couldn't read %s", path);
+
+	fclose(f);
+	return b;
+}
+
+int main(int argc, char *argv[])
+{
+	double seconds = 1;
+	bool json = false;
+	struct workload *w;
+	struct buf b;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "jt:")) != -1)
+		switch (opt) {
+		case 'j':
+			json = true;
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		default:
+			die("usage: stbench [-j] [-t seconds] [recorded...]\n");
+		}
+
+	for (w = workloads; w < workloads + ARRAY_SIZE(workloads); w++) {
+		b = (struct buf) { 0 };
+		seed = 1;
+		w->gen(&b);
+		bench(w->name, &b, seconds, json);
+		free(b.p);
+	}
+
+	for (; optind < argc; optind++) {
+		b = readfile(argv[optind]);
+		bench(argv[optind], &b, seconds, json);
+		free(b.p);
+	}
+
+	return 0;
+}
@@ -48,6 +48,8 @@ static struct st_shortcut shortcuts[] = {
 	{ MODKEY|ShiftMask,	XK_Next,	xzoom,		{.i = -1} },
 	{ ShiftMask,		XK_Insert,	selpaste,	{.i =  0} },
 	{ MODKEY|ShiftMask,	XK_Insert,	clippaste,	{.i =  0} },
+	{ ShiftMask,		XK_Prior,	kscrollup,	{.i = -1} },
+	{ ShiftMask,		XK_Next,	kscrolldown,	{.i = -1} },
 	{ MODKEY,		XK_Num_Lock,	numlock,	{.i =  0} },
 };
 
@@ -0,0 +1,395 @@
+/*
+ * Key to screen latency, end to end: starts st running us as its child, types
+ * into it with XTest, and times how long each key takes to show up in the
+ * window. Run it on a server of its own - make latency does it under Xvfb.
+ *
+ * The child puts the raw tty in charge: every byte it reads, it flips the
+ * first cell of the last line between a solid block and a space. With -f it
+ * also floods the lines above it with output, scrolled in a region that leaves
+ * the last line alone, so we see what a busy terminal does to typing.
+ *
+ * We watch the window with XDamage, and on every damage compare the block's
+ * cell with what it was before the key. Where that cell is, whatever the
+ * border and the font, the first key tells us: it's what changes, as the flood
+ * only starts after it.
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/Xdamage.h>
+
+#include "term.h"
+
+/* st's default size is 80x24 */
+#define ROWS		24
+#define TIMEOUT_MS	1000
+#define QUIET_MS	200
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+/* st went away: so do we */
+static void out(char *s, size_t len)
+{
+	if (xwrite(STDOUT_FILENO, s, len) < 0)
+		exit(EXIT_FAILURE);
+}
+
+/* The child: runs in st, tells us its window and echoes keys where we look */
+static void child(bool flood)
+{
+	const char *fd = getenv("STLATENCY_FD");
+	const char *win = getenv("WINDOWID");
+	struct termios t;
+	char c, buf[128];
+	bool block = false;
+	int len;
+
+	if (!fd || !win)
+		die("stlatency -C is for st to run\n");
+
+	if (tcgetattr(STDIN_FILENO, &t) == 0) {
+		cfmakeraw(&t);
+		tcsetattr(STDIN_FILENO, TCSANOW, &t);
+	}
+
+	len = strlen(win);
+	if (write(atoi(fd), win, len) != len)
+		die("Couldn't tell the window\n");
+	close(atoi(fd));
+
+	out("\033[?25l\033[2J", 10);
+
+	while (read(STDIN_FILENO, &c, 1) == 1) {
+		block = !block;
+		len = snprintf(buf, sizeof(buf), "\033[%u;1H%s", ROWS,
+			       block ? "\033[7m \033[m" : " ");
+		out(buf, len);
+
+		if (flood && !fork()) {
+			unsigned long i;
+
+			/* one write per line, so the echo can't land in the middle */
+			for (i = 0;; i++) {
+				len = snprintf(buf, sizeof(buf),
+					       "\033[1;%ur\033[%u;1H\n%lu the quick "
+					       "brown fox jumps over the lazy dog %lu",
+					       ROWS - 2, ROWS - 2, i, i * 7919);
+				out(buf, len);
+			}
+		}
+		flood = false;
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+struct latency {
+	Display		*dpy;
+	Window		win;
+	int		damage_event;
+	Damage		damage;
+	XRectangle	strip;		/* where the block goes */
+	KeyCode		key;
+	XImage		*before;
+};
+
+static XImage *grab(struct latency *l)
+{
+	return XGetImage(l->dpy, l->win, l->strip.x, l->strip.y,
+			 l->strip.width, l->strip.height, AllPlanes, ZPixmap);
+}
+
+static bool changed(struct latency *l)
+{
+	XImage *img = grab(l);
+	bool ret;
+
+	ret = memcmp(img->data, l->before->data,
+		     img->bytes_per_line * img->height);
+	XDestroyImage(img);
+	return ret;
+}
+
+/* Waits for the window to change, up to TIMEOUT_MS; returns false if it didn't */
+static bool wait_change(struct latency *l, double start)
+{
+	int xfd = ConnectionNumber(l->dpy);
+	bool damaged = false;
+	struct timeval tv;
+	double left;
+	fd_set rfd;
+	XEvent ev;
+
+	while (1) {
+		while (XPending(l->dpy)) {
+			XNextEvent(l->dpy, &ev);
+			if (ev.type == l->damage_event + XDamageNotify)
+				damaged = true;
+		}
+
+		if (damaged) {
+			XDamageSubtract(l->dpy, l->damage, None, None);
+			if (changed(l))
+				return true;
+			damaged = false;
+		}
+
+		left = start + TIMEOUT_MS - now();
+		if (left <= 0)
+			return false;
+
+		tv.tv_sec = left / 1000;
+		tv.tv_usec = (long) (left * 1000) % 1000000;
+
+		FD_ZERO(&rfd);
+		FD_SET(xfd, &rfd);
+		if (select(xfd + 1, &rfd, NULL, NULL, &tv) < 0 &&
+		    errno != EINTR)
+			edie("select failed");
+	}
+}
+
+static void press(struct latency *l)
+{
+	XTestFakeKeyEvent(l->dpy, l->key, True, CurrentTime);
+	XTestFakeKeyEvent(l->dpy, l->key, False, CurrentTime);
+	XFlush(l->dpy);
+}
+
+/* Waits for QUIET_MS without damage: st has drawn whatever it had to */
+static void settle(struct latency *l)
+{
+	double start = now(), quiet = start;
+	XEvent ev;
+
+	XDamageSubtract(l->dpy, l->damage, None, None);
+
+	while (now() - quiet < QUIET_MS) {
+		if (now() - start > 10 * TIMEOUT_MS)
+			die("The window never stopped changing\n");
+
+		while (XPending(l->dpy)) {
+			XNextEvent(l->dpy, &ev);
+			if (ev.type == l->damage_event + XDamageNotify) {
+				XDamageSubtract(l->dpy, l->damage, None, None);
+				quiet = now();
+			}
+		}
+		usleep(10000);
+	}
+}
+
+/*
+ * The first key: what it changes in the window is the block's cell - once
+ * the window is quiet, as the flood only starts after it
+ */
+static void find_block(struct latency *l, XWindowAttributes *attr)
+{
+	int x, y, x1 = attr->width, y1 = attr->height, x2 = -1, y2 = -1;
+	XSizeHints hints;
+	XImage *after;
+	long supplied;
+
+	/* st's resize increments are its cell size */
+	if (!XGetWMNormalHints(l->dpy, l->win, &hints, &supplied) ||
+	    !(hints.flags & PResizeInc))
+		die("No cell size in the window's size hints\n");
+
+	settle(l);
+
+	l->strip = (XRectangle) { 0, 0, attr->width, attr->height };
+	l->before = grab(l);
+	XDamageSubtract(l->dpy, l->damage, None, None);
+
+	press(l);
+	if (!wait_change(l, now()))
+		die("The first key never showed up\n");
+
+	after = grab(l);
+	for (y = 0; y < attr->height; y++)
+		for (x = 0; x < attr->width; x++)
+			if (XGetPixel(after, x, y) !=
+			    XGetPixel(l->before, x, y)) {
+				x1 = min(x1, x);
+				y1 = min(y1, y);
+				x2 = max(x2, x);
+				y2 = max(y2, y);
+			}
+
+	XDestroyImage(after);
+	XDestroyImage(l->before);
+
+	if (x2 < 0)
+		die("The first key changed nothing\n");
+	if (x2 - x1 + 1 > hints.width_inc || y2 - y1 + 1 > hints.height_inc)
+		die("The first key changed %ux%u pixels, more than a %ux%u cell\n",
+		    x2 - x1 + 1, y2 - y1 + 1,
+		    hints.width_inc, hints.height_inc);
+
+	l->strip = (XRectangle) { x1, y1, x2 - x1 + 1, y2 - y1 + 1 };
+}
+
+static int cmp_double(const void *l, const void *r)
+{
+	double a = *(const double *) l, b = *(const double *) r;
+
+	return a < b ? -1 : a > b;
+}
+
+static pid_t start_st(const char *st, bool flood, Window *win)
+{
+	char self[4096], fdstr[16], buf[32];
+	char *argv[] = {
+		(char *) st, "-e", self, "-C",
+		flood ? "-f" : NULL, NULL,
+	};
+	ssize_t len;
+	int fd[2];
+	pid_t pid;
+
+	len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len < 0)
+		edie("Couldn't find myself");
+	self[len] = '\0';
+
+	if (pipe(fd))
+		edie("pipe failed");
+
+	snprintf(fdstr, sizeof(fdstr), "%d", fd[1]);
+	setenv("STLATENCY_FD", fdstr, 1);
+
+	pid = fork();
+	if (pid < 0)
+		edie("fork failed");
+	if (!pid) {
+		close(fd[0]);
+		execvp(st, argv);
+		edie("Couldn't run %s", st);
+	}
+
+	close(fd[1]);
+	len = read(fd[0], buf, sizeof(buf) - 1);
+	if (len <= 0)
+		die("%s didn't start\n", st);
+	buf[len] = '\0';
+	close(fd[0]);
+
+	*win = strtoul(buf, NULL, 10);
+	return pid;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *st = "./st";
+	unsigned i, n = 200, lost = 0, got = 0;
+	bool flood = false, json = false, childmode = false;
+	struct latency l = { 0 };
+	XWindowAttributes attr;
+	double *ms, start;
+	int opt, error_base;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "Cfjn:s:")) != -1)
+		switch (opt) {
+		case 'C':
+			childmode = true;
+			break;
+		case 'f':
+			flood = true;
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'n':
+			n = max(atoi(optarg), 1);
+			break;
+		case 's':
+			st = optarg;
+			break;
+		default:
+			die("usage: stlatency [-f] [-j] [-n keys] [-s st]\n");
+		}
+
+	if (childmode)
+		child(flood);
+
+	l.dpy = XOpenDisplay(NULL);
+	if (!l.dpy)
+		die("Can't open display\n");
+
+	if (!XTestQueryExtension(l.dpy, &opt, &opt, &opt, &opt) ||
+	    !XDamageQueryExtension(l.dpy, &l.damage_event, &error_base))
+		die("Need the XTEST and DAMAGE extensions\n");
+
+	pid = start_st(st, flood, &l.win);
+
+	/* let it map; find_block() waits for it to settle */
+	do {
+		usleep(10000);
+		XGetWindowAttributes(l.dpy, l.win, &attr);
+	} while (attr.map_state != IsViewable);
+
+	XSetInputFocus(l.dpy, l.win, RevertToParent, CurrentTime);
+
+	l.damage = XDamageCreate(l.dpy, l.win, XDamageReportNonEmpty);
+	l.key = XKeysymToKeycode(l.dpy, XK_a);
+	find_block(&l, &attr);
+
+	ms = xcalloc(n, sizeof(*ms));
+
+	for (i = 0; i < n; i++) {
+		/* not in step with the frame rate */
+		usleep(20000 + rand() % 30000);
+
+		l.before = grab(&l);
+		XDamageSubtract(l.dpy, l.damage, None, None);
+
+		start = now();
+		press(&l);
+
+		if (wait_change(&l, start))
+			ms[got++] = now() - start;
+		else
+			lost++;
+
+		XDestroyImage(l.before);
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	if (!got)
+		die("No key ever showed up\n");
+
+	qsort(ms, got, sizeof(*ms), cmp_double);
+
+	if (json)
+		printf("{\"flood\": %s, \"keys\": %u, \"lost\": %u, "
+		       "\"min_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, "
+		       "\"p99_ms\": %.3f, \"max_ms\": %.3f}\n",
+		       flood ? "true" : "false", got, lost, ms[0],
+		       ms[got / 2], ms[got * 9 / 10], ms[got * 99 / 100],
+		       ms[got - 1]);
+	else
+		printf("%s: %u keys, %u lost, ms min %.3f p50 %.3f p90 %.3f "
+		       "p99 %.3f max %.3f\n",
+		       flood ? "flood" : "idle", got, lost, ms[0],
+		       ms[got / 2], ms[got * 9 / 10], ms[got * 99 / 100],
+		       ms[got - 1]);
+
+	return 0;
+}
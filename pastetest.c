@@ -0,0 +1,241 @@
+/*
+ * Pastes a selection bigger than one X request from st into itself: starts st
+ * running us as its child, big enough that a screenful of 4 byte characters
+ * has to go INCR, selects all of it and middle clicks, with XTest. The child
+ * checks that every byte came back. Run it on a server of its own, with a big
+ * screen - make xcheck does it under Xvfb.
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+
+#include "term.h"
+
+/* U+10000, one cell and four bytes */
+#define CHAR		"\xf0\x90\x80\x80"
+#define CHAR_LEN	4
+#define MIN_LEN		(256 * 1024)
+#define TIMEOUT		10
+
+static void report(int fd, const char *fmt, ...)
+{
+	char buf[128];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (write(fd, buf, len) != len)
+		exit(EXIT_FAILURE);
+}
+
+/*
+ * The child: runs in st, fills the screen when told to, then reads back what's
+ * pasted and tells us how it went
+ */
+static void child(void)
+{
+	const char *fdstr = getenv("STPASTE_FD");
+	size_t i, len, got = 0, bad = 0;
+	struct winsize ws;
+	struct termios t;
+	char buf[4096];
+	int fd;
+	ssize_t n;
+
+	if (!fdstr)
+		die("stpastetest -C is for st to run\n");
+	fd = atoi(fdstr);
+
+	if (tcgetattr(STDIN_FILENO, &t) == 0) {
+		cfmakeraw(&t);
+		tcsetattr(STDIN_FILENO, TCSANOW, &t);
+	}
+
+	report(fd, "%s\n", getenv("WINDOWID"));
+
+	/* the window is its final size by the time a key gets here */
+	if (read(STDIN_FILENO, buf, 1) != 1 ||
+	    ioctl(STDIN_FILENO, TIOCGWINSZ, &ws))
+		edie("Couldn't get the size");
+
+	len = (size_t) ws.ws_col * ws.ws_row * CHAR_LEN;
+	if (len <= MIN_LEN) {
+		report(fd, "screen too small: %ux%u\n", ws.ws_col, ws.ws_row);
+		exit(EXIT_FAILURE);
+	}
+
+	if (xwrite(STDOUT_FILENO, "\033[?25l\033[H", 9) < 0)
+		exit(EXIT_FAILURE);
+	for (i = 0; i < (size_t) ws.ws_col * ws.ws_row; i++)
+		if (xwrite(STDOUT_FILENO, CHAR, CHAR_LEN) < 0)
+			exit(EXIT_FAILURE);
+
+	/* where the cells are, for selecting them */
+	report(fd, "%zu %u %u\n", len, ws.ws_xpixel, ws.ws_ypixel);
+
+	alarm(TIMEOUT);
+	while (got < len && (n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i++)
+			bad += buf[i] != CHAR[(got + i) % CHAR_LEN];
+		got += n;
+	}
+
+	report(fd, "%zu %zu\n", got, bad);
+	exit(EXIT_SUCCESS);
+}
+
+static pid_t start_st(const char *st, const char *geometry, int fd[2])
+{
+	char self[4096], fdstr[16];
+	char *argv[] = {
+		(char *) st, "-g", (char *) geometry, "-e", self, "-C", NULL,
+	};
+	ssize_t len;
+	pid_t pid;
+
+	len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len < 0)
+		edie("Couldn't find myself");
+	self[len] = '\0';
+
+	if (pipe(fd))
+		edie("pipe failed");
+
+	snprintf(fdstr, sizeof(fdstr), "%d", fd[1]);
+	setenv("STPASTE_FD", fdstr, 1);
+
+	pid = fork();
+	if (pid < 0)
+		edie("fork failed");
+	if (!pid) {
+		close(fd[0]);
+		execvp(st, argv);
+		edie("Couldn't run %s", st);
+	}
+
+	close(fd[1]);
+	return pid;
+}
+
+/* A line from the child, or nothing within TIMEOUT */
+static bool child_says(FILE *f, char *buf, size_t size)
+{
+	alarm(TIMEOUT);
+	if (!fgets(buf, size, f))
+		return false;
+	alarm(0);
+	return true;
+}
+
+static void click(Display *dpy, unsigned button, int x, int y, int x2, int y2)
+{
+	XTestFakeMotionEvent(dpy, -1, x, y, CurrentTime);
+	XTestFakeButtonEvent(dpy, button, True, CurrentTime);
+	XTestFakeMotionEvent(dpy, -1, x2, y2, CurrentTime);
+	XTestFakeButtonEvent(dpy, button, False, CurrentTime);
+	XFlush(dpy);
+	usleep(100000);
+}
+
+static void timeout(int sig)
+{
+	die("stpastetest: timed out\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *st = "./st", *geometry = "8000x4000";
+	size_t len, got, bad;
+	unsigned width, height;
+	bool childmode = false;
+	XWindowAttributes attr;
+	Display *dpy;
+	Window win, child_win;
+	char line[128];
+	int opt, fd[2], x, y;
+	FILE *f;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "Cg:s:")) != -1)
+		switch (opt) {
+		case 'C':
+			childmode = true;
+			break;
+		case 'g':
+			geometry = optarg;
+			break;
+		case 's':
+			st = optarg;
+			break;
+		default:
+			die("usage: stpastetest [-g geometry] [-s st]\n");
+		}
+
+	if (childmode)
+		child();
+
+	signal(SIGALRM, timeout);
+
+	dpy = XOpenDisplay(NULL);
+	if (!dpy)
+		die("Can't open display\n");
+
+	if (!XTestQueryExtension(dpy, &opt, &opt, &opt, &opt))
+		die("Need the XTEST extension\n");
+
+	pid = start_st(st, geometry, fd);
+	f = fdopen(fd[0], "r");
+
+	if (!child_says(f, line, sizeof(line)))
+		die("%s didn't start\n", st);
+	win = strtoul(line, NULL, 10);
+
+	do {
+		usleep(10000);
+		XGetWindowAttributes(dpy, win, &attr);
+	} while (attr.map_state != IsViewable);
+	usleep(200000);
+
+	XTranslateCoordinates(dpy, win, attr.root, 0, 0, &x, &y, &child_win);
+	XSetInputFocus(dpy, win, RevertToParent, CurrentTime);
+
+	/* any key: the child fills the screen */
+	XTestFakeKeyEvent(dpy, XKeysymToKeycode(dpy, XK_space), True, CurrentTime);
+	XTestFakeKeyEvent(dpy, XKeysymToKeycode(dpy, XK_space), False, CurrentTime);
+	XFlush(dpy);
+
+	if (!child_says(f, line, sizeof(line)))
+		die("The child never filled the screen\n");
+	if (sscanf(line, "%zu %u %u", &len, &width, &height) != 3)
+		die("%s", line);
+	usleep(500000);
+
+	/*
+	 * Corner to corner: half of what's left around the cells is past the
+	 * border but short of the second cell, and st takes anything past the
+	 * last cell as the last cell
+	 */
+	x += (attr.width - width) / 2;
+	y += (attr.height - height) / 2;
+	click(dpy, Button1, x, y, x + attr.width, y + attr.height);
+	click(dpy, Button2, x, y, x, y);
+
+	if (!child_says(f, line, sizeof(line)) ||
+	    sscanf(line, "%zu %zu", &got, &bad) != 2)
+		die("The paste never arrived\n");
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	printf("self paste: %zu of %zu bytes, %zu wrong\n", got, len, bad);
+	return got == len && !bad ? EXIT_SUCCESS : EXIT_FAILURE;
+}
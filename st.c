@@ -5,13 +5,18 @@
 #include <limits.h>
 #include <locale.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
+#include <sys/ipc.h>
 #include <sys/select.h>
+#include <sys/shm.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
@@ -20,16 +25,25 @@
 #include <X11/Xutil.h>
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrender.h>
 #include <X11/Xft/Xft.h>
 #include <fontconfig/fontconfig.h>
 #include <gio/gio.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "term.h"
 
 #define USAGE \
 	"st " VERSION " (c) 2010-2013 st engineers\n" \
 	"usage: st [-v] [-c class] [-g geometry] [-o file]" \
-	" [-t title] [-w windowid] [-e command ...]\n"
+	" [-t title] [-w windowid] [-e command ...]\n" \
+	"       st -B file [-n frames] [-g geometry]\n"
 
 /* XEMBED messages */
 #define XEMBED_FOCUS_IN  4
@@ -40,24 +54,177 @@
 #define XK_NO_MOD     0
 #define XK_SWITCH_MOD (1<<13)
 
+/* INCR selection transfers the other side stopped answering are dropped (ms) */
+#define INCR_TIMEOUT	10000
+
+/* damage this soon after a key press is drawn right away, as its echo (ms) */
+#define ECHO_TIMEOUT	1000
+
 /* macros */
 #define TIMEDIFF(t1, t2) ((t1.tv_sec-t2.tv_sec)*1000 + (t1.tv_usec-t2.tv_usec)/1000)
 
+/* Open addressing hash table from a key to a glyph of some font */
+struct st_glyphcache_entry {
+	unsigned	key;		/* key + 1, 0 if unused */
+	unsigned	glyph;
+	XftFont		*font;
+};
+
+struct st_glyphcache {
+	struct st_glyphcache_entry *table;
+	unsigned	size;		/* power of two */
+	unsigned	nr;
+};
+
+/* code points below this get looked up in a flat table */
+#define GLYPHCACHE_DIRECT	0x250
+
 struct st_font {
 	XftFont		*match;
 	FcFontSet	*set;
 	FcPattern	*pattern;
+
+	/* which font and glyph draws each character, see font_glyph() */
+	struct st_glyphcache_entry direct[GLYPHCACHE_DIRECT];
+	struct st_glyphcache glyphs;
+};
+
+enum {
+	FRC_NORMAL,
+	FRC_ITALIC,
+	FRC_BOLD,
+	FRC_ITALICBOLD
 };
 
+/*
+ * Fallback fonts for characters the main fonts don't have: maps (code point,
+ * style) to one of the fallback fonts opened so far, or to nothing if no font
+ * has the character either.
+ */
 struct st_fontcache {
-	XftFont		*font;
-	unsigned	c;
-	enum {
-		FRC_NORMAL,
-		FRC_ITALIC,
-		FRC_BOLD,
-		FRC_ITALICBOLD
-	} flags;
+	struct st_glyphcache map;	/* key is c << 2 | style */
+	XftFont		**fonts;
+	unsigned	nfonts;
+	unsigned long	hits, misses;
+};
+
+/*
+ * XftColors for 24 bit colors, keyed by color, the least recently used one
+ * making way when it's full - so they aren't allocated every time a cell is
+ * drawn:
+ */
+#define RGBCACHE_SIZ	256
+
+struct st_rgbcache_entry {
+	uint32_t	rgb;		/* TRUECOLOR_USED | rgb, 0 if unused */
+	unsigned short	next;		/* in the hash chain, index + 1 */
+	unsigned long	used;		/* clock when last used */
+	unsigned long	frame;		/* frame when last used */
+	XftColor	color;
+};
+
+struct st_rgbcache {
+	struct st_rgbcache_entry entries[RGBCACHE_SIZ];
+	unsigned short	buckets[RGBCACHE_SIZ]; /* index + 1, 0 if empty */
+	unsigned long	clock, frame;
+	unsigned long	hits, misses;
+
+	/* evicted while this frame's batches may still use them */
+	XftColor	*dead;
+	unsigned	ndead, deadsize;
+};
+
+/*
+ * What a frame draws in one color, sent to the server by batch_flush(): all
+ * backgrounds first, then glyphs, then underlines.
+ */
+struct st_batch {
+	XftColor	color;
+	XRectangle	*rects;
+	XftGlyphFontSpec *specs;
+	XRectangle	*lines;
+	unsigned	nrects, nspecs, nlines;
+	unsigned	rectsize, specsize, linesize;
+};
+
+/* A glyph rendered by FreeType, coverage bytes in st_shm.atlas */
+struct st_atlas_entry {
+	XftFont		*font;		/* NULL if unused */
+	unsigned	glyph;
+	unsigned	offset;
+	unsigned short	width, height;
+	short		left, top;	/* from the glyph origin */
+};
+
+/* Something to composite: the idx'th rect, glyph or line of a batch */
+struct st_op {
+	unsigned	kind:2;
+	unsigned	batch:30;
+	unsigned	idx;
+};
+
+enum { OP_RECT, OP_GLYPH, OP_LINE };
+
+/*
+ * The pixel rows of one row of cells (plus the border, at the edges), and the
+ * ops that touch them, in drawing order:
+ */
+struct st_band {
+	unsigned	y1, y2;
+	struct st_op	*ops;
+	unsigned	nops, size;
+};
+
+/*
+ * Threads compositing bands in parallel: each starts on its own share of the
+ * bands, then steals from the others' once it runs out.
+ */
+struct st_worker {
+	struct st_window *xw;
+	unsigned	idx;
+	uint64_t	queue;		/* next band << 32 | end, see queue_pop() */
+};
+
+struct st_pool {
+	struct st_worker *workers;	/* [0] is the main thread */
+	unsigned	nworkers;
+	unsigned	active;		/* how many take part, see bench() */
+	pthread_mutex_t	lock;
+	pthread_cond_t	start, done;
+	unsigned	generation;	/* bumped to start a frame */
+	unsigned	running;
+};
+
+/*
+ * MIT-SHM backend state: the frame is drawn client side, into an XImage in
+ * memory shared with the server.
+ */
+struct st_shm {
+	XShmSegmentInfo	info;
+	XImage		*img;
+	bool		busy;		/* server may still be reading img */
+
+	struct st_band	*bands;
+	unsigned	nbands, bandsize;
+	unsigned	*work;		/* bands with something to do */
+	unsigned	nwork;
+	struct st_pool	pool;
+
+	struct st_atlas_entry *table;	/* power of two */
+	unsigned	size, nr;
+	unsigned char	*atlas;
+	unsigned	atlaslen, atlassize;
+};
+
+/* A selection we're sending with the INCR protocol, a chunk at a time */
+struct st_incr {
+	struct st_incr	*next;
+	Window		requestor;
+	Atom		property;
+	Atom		target;
+	struct st_clip	*clip;
+	size_t		offset;
+	struct timeval	last;		/* last chunk sent */
 };
 
 struct st_key {
@@ -79,6 +246,19 @@ union st_arg {
 
 struct st_window;
 
+/*
+ * Turns the batches into pixels, in a buffer the size of the window that's
+ * copied to the window where damaged. Coordinates are in pixels.
+ */
+struct st_backend {
+	const char	*name;
+	bool (*resize)(struct st_window *); /* (re)create the buffer, cleared */
+	void (*scroll)(struct st_window *, unsigned src, unsigned dst,
+		       unsigned height);
+	void (*flush)(struct st_window *);
+	void (*copy)(struct st_window *, XRectangle);
+};
+
 struct st_shortcut {
 	unsigned int	mod;
 	KeySym		keysym;
@@ -90,16 +270,28 @@ struct st_shortcut {
 static void clippaste(struct st_window *, const union st_arg *);
 static void selpaste(struct st_window *, const union st_arg *);
 static void numlock(struct st_window *, const union st_arg *);
+static void kscrollup(struct st_window *, const union st_arg *);
+static void kscrolldown(struct st_window *, const union st_arg *);
 static void xzoom(struct st_window *, const union st_arg *);
 
 /* Config.h for applying patches and the configuration. */
 #include "config.h"
 
+#define NCOLORS	(ARRAY_SIZE(colorname) < 256 ? 256 : ARRAY_SIZE(colorname))
+
 struct st_window {
 	struct st_term	term;
+	struct st_snapshot snap;	/* what draw() works from */
+
+	/* with threaded set, the shell is read on another thread: */
+	bool		threaded;
+	pthread_mutex_t	lock;		/* held around anything using term */
+	int		wakefd[2];	/* reader to us: term is dirty */
 
 	/* Graphic info */
-	XftColor	col[ARRAY_SIZE(colorname) < 256 ? 256 : ARRAY_SIZE(colorname)];
+	XftColor	col[NCOLORS];
+	XftColor	rcol[NCOLORS];	/* with reverse video */
+	unsigned short	bold[NCOLORS];	/* color of bold text in col[i] */
 	GC		gc;
 	Display		*dpy;
 	Colormap	cmap;
@@ -112,6 +304,14 @@ struct st_window {
 	XftDraw		*draw;
 	Visual		*vis;
 	Atom		selection;
+	Atom		xa_targets;
+	Atom		xa_incr;
+	unsigned	incrsize;	/* selections bigger than this go INCR */
+	struct st_incr	*incr;		/* transfers in progress */
+	Atom		paste;		/* property a paste is read from */
+	long		pasteofs;	/* how far, in 32 bit units */
+	bool		pasteincr;	/* it's coming in INCR chunks */
+	bool		pastewait;	/* for the next chunk */
 	char		*default_title;
 	char		*class;
 	char		*embed;
@@ -119,12 +319,30 @@ struct st_window {
 	GSettings	*settings;
 	unsigned	borderpx;
 	unsigned	fps;
+	unsigned	scrollback;
+	unsigned	readslice;	/* ms to read the shell for at once */
 	unsigned	doubleclicktimeout;
 	unsigned	tripleclicktimeout;
 
+	const struct st_backend *backend;
+	bool		useshm;
+	unsigned	renderthreads;	/* 0: one per CPU, up to 8 */
+	struct st_shm	shm;
+	struct st_batch	*batch;
+	unsigned	nbatch, batchsize;
+	bool		logframes;
+	/* dumped with the terminal's on SIGUSR1, see statsdump() */
+	unsigned long	frames;
+	unsigned long	cells;		/* repainted */
+	unsigned long	draw_us, flush_us;
+
+	const char	*bench;		/* st -B: render benchmark of this */
+	unsigned	benchframes;
+
 	struct st_font	font, bfont, ifont, ibfont;
 	int		fontzoom;
-	struct st_fontcache fontcache[32];
+	struct st_fontcache fontcache;
+	struct st_rgbcache rgbcache;
 
 	int		scr;
 	bool		isfixed;	/* is fixed geometry? */
@@ -132,6 +350,18 @@ struct st_window {
 	struct coord	winsize;
 	struct coord	fixedsize;	/* kill? */
 	struct coord	charsize;
+	struct coord	cursor;		/* where the cursor was last drawn */
+
+	/* frame scheduling, see schedule() */
+	struct timeval	next_redraw;
+	struct timeval	timeout;
+	struct timeval	lastkey;	/* last key press that did something */
+	struct timeval	lastread;	/* last output of the shell parsed */
+	unsigned	delay;		/* current frame interval, us */
+	bool		echo_pending;	/* echo of lastkey not drawn yet */
+	bool		echo_frame;	/* the frame being drawn has it */
+	bool		waited;		/* damage had to wait for next_redraw */
+	bool		loglatency;
 
 	struct timeval	mousedown_time;
 	struct coord	mousedown_pos;
@@ -145,6 +375,18 @@ struct st_window {
 
 /* X utility code */
 
+static struct timeval monotonic_gettime(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (struct timeval) {
+		.tv_sec = now.tv_sec,
+		.tv_usec = now.tv_nsec / 1000,
+	};
+}
+
 static unsigned short sixd_to_16bit(int x)
 {
 	return x == 0 ? 0 : 0x3737 + 0x2828 * x;
@@ -163,6 +405,43 @@ static bool match(unsigned mask, unsigned state)
 	return true;
 }
 
+/* With reverse video, the default colors swap and all others invert: */
+static void xloadreverse(struct st_window *xw, unsigned i)
+{
+	XRenderColor color = xw->col[i].color;
+
+	if (i == defaultfg) {
+		color = xw->col[defaultbg].color;
+	} else if (i == defaultbg) {
+		color = xw->col[defaultfg].color;
+	} else {
+		color.red	= ~color.red;
+		color.green	= ~color.green;
+		color.blue	= ~color.blue;
+	}
+
+	if (!XftColorAllocValue(xw->dpy, xw->vis, xw->cmap,
+				&color, &xw->rcol[i]))
+		die("Could not allocate reverse color %d\n", i);
+}
+
+static int xsetcolor(struct st_window *xw, unsigned x, XftColor *colour)
+{
+	xw->col[x] = *colour;
+
+	XftColorFree(xw->dpy, xw->vis, xw->cmap, &xw->rcol[x]);
+	xloadreverse(xw, x);
+
+	/* reversed, the default colors are each other */
+	if (x == defaultfg || x == defaultbg) {
+		x = x == defaultfg ? defaultbg : defaultfg;
+		XftColorFree(xw->dpy, xw->vis, xw->cmap, &xw->rcol[x]);
+		xloadreverse(xw, x);
+	}
+
+	return 1;
+}
+
 static int xsetcolorname(struct st_term *term,
 			 int x, const char *name)
 {
@@ -182,24 +461,21 @@ static int xsetcolorname(struct st_term *term,
 			if (!XftColorAllocValue(xw->dpy, xw->vis,
 						xw->cmap, &color, &colour))
 				return 0;	/* something went wrong */
-			xw->col[x] = colour;
-			return 1;
+			return xsetcolor(xw, x, &colour);
 		} else if (16 + 216 <= x && x < 256) {
 			color.red = color.green = color.blue =
 			    0x0808 + 0x0a0a * (x - (16 + 216));
 			if (!XftColorAllocValue(xw->dpy, xw->vis,
 						xw->cmap, &color, &colour))
 				return 0;	/* something went wrong */
-			xw->col[x] = colour;
-			return 1;
+			return xsetcolor(xw, x, &colour);
 		} else {
 			name = colorname[x];
 		}
 	}
 	if (!XftColorAllocName(xw->dpy, xw->vis, xw->cmap, name, &colour))
 		return 0;
-	xw->col[x] = colour;
-	return 1;
+	return xsetcolor(xw, x, &colour);
 }
 
 static void xsettitle(struct st_term *term, char *title)
@@ -243,27 +519,67 @@ static void xsetsel(struct st_window *xw)
 
 /* Selection code */
 
-static void selnotify(struct st_window *xw, XEvent *e)
+/*
+ * Writes the paste to the tty a piece at a time, as long as the shell keeps up
+ * with it, so a huge one doesn't pile up in memory. The property is deleted
+ * when we've read the end of it, which is what makes INCR owners send the next
+ * chunk - until then they wait for us.
+ */
+static void paste(struct st_window *xw)
 {
-	unsigned long nitems, ofs, rem;
+	unsigned long nitems, rem;
 	int format;
 	unsigned char *data;
 	Atom type;
 
-	ofs = 0;
-	do {
+	while (xw->paste != None && !xw->pastewait &&
+	       xw->term.out.len < TTYQ_MAX) {
 		if (XGetWindowProperty
-		    (xw->dpy, xw->win, XA_PRIMARY, ofs, BUFSIZ / 4, False,
+		    (xw->dpy, xw->win, xw->paste, xw->pasteofs,
+		     (TTYQ_MAX - xw->term.out.len + 3) / 4, True,
 		     AnyPropertyType, &type, &format, &nitems, &rem,
 		     &data)) {
 			fprintf(stderr, "Clipboard allocation failed\n");
+			xw->paste = None;
 			return;
 		}
-		ttywrite(&xw->term, (const char *) data, nitems * format / 8);
+
+		if (type == xw->xa_incr) {
+			/* too big for one property: chunks are coming */
+			xw->pasteincr = true;
+			xw->pastewait = true;
+		} else if (type == None) {
+			/* no chunk yet, or no paste at all */
+			xw->pastewait = xw->pasteincr;
+			if (!xw->pasteincr)
+				xw->paste = None;
+		} else {
+			ttywrite(&xw->term, (const char *) data,
+				 nitems * format / 8);
+			/* number of 32-bit chunks returned */
+			xw->pasteofs += nitems * format / 32;
+
+			if (!rem) {
+				xw->pasteofs = 0;
+				xw->pastewait = true;
+				/* INCR transfers end with an empty chunk */
+				if (!xw->pasteincr || !nitems)
+					xw->paste = None;
+			}
+		}
+
 		XFree(data);
-		/* number of 32-bit chunks returned */
-		ofs += nitems * format / 32;
-	} while (rem > 0);
+	}
+}
+
+static void selnotify(struct st_window *xw, XEvent *e)
+{
+	xw->paste = e->xselection.property;
+	xw->pasteofs = 0;
+	xw->pasteincr = false;
+	xw->pastewait = false;
+
+	paste(xw);
 }
 
 static void selpaste(struct st_window *xw, const union st_arg *dummy)
@@ -286,12 +602,131 @@ static void selclear(struct st_window *xw, XEvent *e)
 	term_sel_stop(&xw->term);
 }
 
+/* Requestors of INCR transfers can go away in the middle of one */
+static int (*xerrorxlib)(Display *, XErrorEvent *);
+
+static int xerror(Display *dpy, XErrorEvent *e)
+{
+	if (e->error_code == BadWindow)
+		return 0;
+
+	return xerrorxlib(dpy, e);
+}
+
+static void incr_free(struct st_incr **p)
+{
+	struct st_incr *incr = *p;
+
+	*p = incr->next;
+	clip_put(incr->clip);
+	free(incr);
+}
+
+/* Forgets transfers gone quiet, and any to @requestor's @property */
+static void incr_reap(struct st_window *xw, Window requestor, Atom property)
+{
+	struct timeval now = monotonic_gettime();
+	struct st_incr **p, *incr;
+
+	for (p = &xw->incr; (incr = *p);)
+		if ((incr->requestor == requestor &&
+		     incr->property == property) ||
+		    TIMEDIFF(now, incr->last) > INCR_TIMEOUT)
+			incr_free(p);
+		else
+			p = &incr->next;
+}
+
+/*
+ * Announces a transfer with an INCR property; the chunks go out as the
+ * requestor deletes the property, see incr_send()
+ */
+static void incr_start(struct st_window *xw, XSelectionRequestEvent *xsre,
+		       struct st_clip *clip)
+{
+	struct st_incr *incr;
+	long len = clip->len;
+
+	incr_reap(xw, xsre->requestor, xsre->property);
+
+	incr = xmalloc(sizeof(*incr));
+	*incr = (struct st_incr) {
+		.next		= xw->incr,
+		.requestor	= xsre->requestor,
+		.property	= xsre->property,
+		.target		= xsre->target,
+		.clip		= clip_get(clip),
+		.last		= monotonic_gettime(),
+	};
+	xw->incr = incr;
+
+	/* pasting from ourselves, our window already has it in its mask */
+	if (xsre->requestor != xw->win)
+		XSelectInput(xw->dpy, xsre->requestor, PropertyChangeMask);
+	XChangeProperty(xw->dpy, xsre->requestor, xsre->property,
+			xw->xa_incr, 32, PropModeReplace,
+			(unsigned char *) &len, 1);
+}
+
+/* The requestor took the last chunk: send the next, empty when done */
+static void incr_send(struct st_window *xw, Window requestor, Atom property)
+{
+	struct st_incr **p, *incr;
+	size_t len;
+
+	for (p = &xw->incr; (incr = *p); p = &incr->next)
+		if (incr->requestor == requestor &&
+		    incr->property == property)
+			break;
+
+	if (!incr)
+		return;
+
+	len = min_t(size_t, incr->clip->len - incr->offset, xw->incrsize);
+
+	XChangeProperty(xw->dpy, requestor, property, incr->target, 8,
+			PropModeReplace,
+			(unsigned char *) incr->clip->data + incr->offset, len);
+
+	incr->offset += len;
+	incr->last = monotonic_gettime();
+
+	if (!len)
+		incr_free(p);
+}
+
+/* STRING is Latin-1: what isn't in it becomes '?' */
+static struct st_clip *clip_latin1(struct st_clip *utf8)
+{
+	struct st_clip *clip = xmalloc(sizeof(*clip) + utf8->len + 1);
+	const FcChar8 *p = (FcChar8 *) utf8->data, *end = p + utf8->len;
+	char *out = clip->data;
+	FcChar32 ucs;
+	int len;
+
+	while (p < end) {
+		len = FcUtf8ToUcs4(p, &ucs, end - p);
+		if (len <= 0) {
+			ucs = '?';
+			len = 1;
+		}
+
+		*out++ = ucs < 0x100 ? ucs : '?';
+		p += len;
+	}
+
+	*out = '\0';
+	clip->refs = 1;
+	clip->size = utf8->len + 1;
+	clip->len = out - clip->data;
+	return clip;
+}
+
 static void selrequest(struct st_window *xw, XEvent *e)
 {
-	struct st_selection *sel = &xw->term.sel;
 	XSelectionRequestEvent *xsre;
 	XSelectionEvent xev;
-	Atom xa_targets, string;
+	struct st_clip *clip;
 
 	xsre = (XSelectionRequestEvent *) e;
 	xev.type = SelectionNotify;
@@ -302,20 +737,35 @@ static void selrequest(struct st_window *xw, XEvent *e)
 	/* reject */
 	xev.property = None;
 
-	xa_targets = XInternAtom(xw->dpy, "TARGETS", 0);
-	if (xsre->target == xa_targets) {
-		/* respond with the supported type */
-		string = xw->selection;
+	/* obsolete clients leave the property to us */
+	if (xsre->property == None)
+		xsre->property = xsre->target;
+
+	if (xsre->target == xw->xa_targets) {
+		/* respond with the supported types */
+		Atom targets[] = { xw->xa_targets, xw->selection, XA_STRING };
+
 		XChangeProperty(xsre->display, xsre->requestor,
 				xsre->property, XA_ATOM, 32,
-				PropModeReplace, (unsigned char *) & string, 1);
+				PropModeReplace, (unsigned char *) targets,
+				ARRAY_SIZE(targets));
 		xev.property = xsre->property;
-	} else if (xsre->target == xw->selection && sel->clip != NULL) {
-		XChangeProperty(xsre->display, xsre->requestor,
-				xsre->property, xsre->target, 8,
-				PropModeReplace, (unsigned char *) sel->clip,
-				strlen(sel->clip));
+	} else if ((xsre->target == xw->selection ||
+		    xsre->target == XA_STRING) &&
+		   (clip = term_sel_text(&xw->term))) {
+		clip = xsre->target == XA_STRING
+			? clip_latin1(clip)
+			: clip_get(clip);
+
+		if (clip->len > xw->incrsize)
+			incr_start(xw, xsre, clip);
+		else
+			XChangeProperty(xsre->display, xsre->requestor,
+					xsre->property, xsre->target, 8,
+					PropModeReplace,
+					(unsigned char *) clip->data, clip->len);
 		xev.property = xsre->property;
+		clip_put(clip);
 	}
 
 	/* all done, send a notification to the listener */
@@ -324,8 +774,825 @@ static void selrequest(struct st_window *xw, XEvent *e)
 		fprintf(stderr, "Error sending SelectionNotify event\n");
 }
 
+/*
+ * INCR transfers, both ways, move a chunk at a time on property changes - on
+ * our own window, both at once when we paste our own selection
+ */
+static void propnotify(struct st_window *xw, XEvent *e)
+{
+	XPropertyEvent *xpe = &e->xproperty;
+
+	if (xpe->state == PropertyDelete) {
+		incr_send(xw, xpe->window, xpe->atom);
+	} else if (xpe->window == xw->win &&
+		   xw->paste != None &&
+		   xw->pasteincr &&
+		   xpe->atom == xw->paste) {
+		xw->pastewait = false;
+		paste(xw);
+	}
+}
+
 /* Screen drawing code */
 
+static void *grow(void *p, unsigned *size, unsigned nr, size_t elem)
+{
+	unsigned old;
+
+	if (nr < *size)
+		return p;
+
+	old = *size;
+	*size = max(*size * 2, 64U);
+	p = xrealloc(p, *size * elem);
+	memset(p + old * elem, 0, (*size - old) * elem);
+	return p;
+}
+
+static struct st_batch *batch_get(struct st_window *xw, XftColor *color)
+{
+	struct st_batch *b;
+
+	for (b = xw->batch; b < xw->batch + xw->nbatch; b++)
+		if (!memcmp(&b->color.color, &color->color,
+			    sizeof(color->color)))
+			return b;
+
+	xw->batch = grow(xw->batch, &xw->batchsize, xw->nbatch, sizeof(*b));
+	b = &xw->batch[xw->nbatch++];
+	b->color = *color;
+	b->nrects = b->nspecs = b->nlines = 0;
+	return b;
+}
+
+static void batch_rect(struct st_window *xw, XftColor *color,
+		       int x, int y, unsigned w, unsigned h)
+{
+	struct st_batch *b = batch_get(xw, color);
+
+	b->rects = grow(b->rects, &b->rectsize, b->nrects, sizeof(XRectangle));
+	b->rects[b->nrects++] = (XRectangle) { x, y, w, h };
+}
+
+static void batch_line(struct st_window *xw, XftColor *color,
+		       int x, int y, unsigned w, unsigned h)
+{
+	struct st_batch *b = batch_get(xw, color);
+
+	b->lines = grow(b->lines, &b->linesize, b->nlines, sizeof(XRectangle));
+	b->lines[b->nlines++] = (XRectangle) { x, y, w, h };
+}
+
+static void batch_glyph(struct st_window *xw, XftColor *color,
+			XftFont *font, unsigned glyph, int x, int y)
+{
+	struct st_batch *b = batch_get(xw, color);
+
+	b->specs = grow(b->specs, &b->specsize, b->nspecs,
+			sizeof(XftGlyphFontSpec));
+	b->specs[b->nspecs++] = (XftGlyphFontSpec) {
+		.font = font, .glyph = glyph, .x = x, .y = y,
+	};
+}
+
+/* Xft backend: everything is drawn by the server, into a pixmap */
+
+static bool xft_resize(struct st_window *xw)
+{
+	if (xw->buf)
+		XFreePixmap(xw->dpy, xw->buf);
+	xw->buf = XCreatePixmap(xw->dpy, xw->win,
+				xw->winsize.x, xw->winsize.y,
+				DefaultDepth(xw->dpy, xw->scr));
+	XSetForeground(xw->dpy, xw->gc,
+		       xw->col[xw->term.reverse ? defaultfg : defaultbg].
+		       pixel);
+	XFillRectangle(xw->dpy, xw->buf, xw->gc, 0, 0,
+		       xw->winsize.x, xw->winsize.y);
+
+	if (xw->draw)
+		XftDrawChange(xw->draw, xw->buf);
+	else
+		xw->draw = XftDrawCreate(xw->dpy, xw->buf,
+					 xw->vis, xw->cmap);
+	return true;
+}
+
+static void xft_scroll(struct st_window *xw, unsigned src, unsigned dst,
+		       unsigned height)
+{
+	XCopyArea(xw->dpy, xw->buf, xw->buf, xw->gc,
+		  0, src, xw->winsize.x, height, 0, dst);
+}
+
+static void xft_fill(struct st_window *xw, Picture pic, XftColor *color,
+		     XRectangle *rects, unsigned nr)
+{
+	if (pic) {
+		XRenderFillRectangles(xw->dpy, PictOpSrc, pic, &color->color,
+				      rects, nr);
+	} else {
+		while (nr--) {
+			XftDrawRect(xw->draw, color, rects->x, rects->y,
+				    rects->width, rects->height);
+			rects++;
+		}
+	}
+}
+
+/* One request per color and kind, instead of a few per run of cells: */
+static void xft_flush(struct st_window *xw)
+{
+	Picture pic = XftDrawPicture(xw->draw);
+	struct st_batch *b;
+
+	for (b = xw->batch; b < xw->batch + xw->nbatch; b++)
+		if (b->nrects)
+			xft_fill(xw, pic, &b->color, b->rects, b->nrects);
+
+	for (b = xw->batch; b < xw->batch + xw->nbatch; b++)
+		if (b->nspecs)
+			XftDrawGlyphFontSpec(xw->draw, &b->color,
+					     b->specs, b->nspecs);
+
+	for (b = xw->batch; b < xw->batch + xw->nbatch; b++)
+		if (b->nlines)
+			xft_fill(xw, pic, &b->color, b->lines, b->nlines);
+}
+
+static void xft_copy(struct st_window *xw, XRectangle r)
+{
+	XCopyArea(xw->dpy, xw->buf, xw->win, xw->gc,
+		  r.x, r.y, r.width, r.height, r.x, r.y);
+}
+
+static const struct st_backend xft_backend = {
+	.name	= "xft",
+	.resize	= xft_resize,
+	.scroll	= xft_scroll,
+	.flush	= xft_flush,
+	.copy	= xft_copy,
+};
+
+/*
+ * MIT-SHM backend: glyphs are rendered once by FreeType into the atlas, and
+ * frames are composited client side, so the server only ever sees
+ * XShmPutImage for the damaged parts of the window.
+ */
+
+static uint32_t shm_pixel(XftColor *color)
+{
+	return 0xff000000 |
+	       (color->color.red >> 8) << 16 |
+	       (color->color.green >> 8) << 8 |
+	       (color->color.blue >> 8);
+}
+
+/* Don't touch the image while the server may be reading it: */
+static void shm_wait(struct st_window *xw)
+{
+	if (xw->shm.busy) {
+		XSync(xw->dpy, False);
+		xw->shm.busy = false;
+	}
+}
+
+static void shm_release(struct st_window *xw)
+{
+	struct st_shm *shm = &xw->shm;
+
+	if (!shm->img)
+		return;
+
+	shm_wait(xw);
+	XShmDetach(xw->dpy, &shm->info);
+	XDestroyImage(shm->img);
+	shmdt(shm->info.shmaddr);
+	shm->img = NULL;
+}
+
+static bool shm_error;
+
+static int shm_errorhandler(Display *dpy, XErrorEvent *e)
+{
+	shm_error = true;
+	return 0;
+}
+
+static bool shm_resize(struct st_window *xw)
+{
+	struct st_shm *shm = &xw->shm;
+	int (*handler)(Display *, XErrorEvent *);
+	uint32_t *p, *end, bg;
+	XImage *img;
+
+	shm_release(xw);
+
+	img = XShmCreateImage(xw->dpy, xw->vis, DefaultDepth(xw->dpy, xw->scr),
+			      ZPixmap, NULL, &shm->info,
+			      xw->winsize.x, xw->winsize.y);
+	if (!img)
+		return false;
+
+	if (img->bits_per_pixel != 32) {
+		XDestroyImage(img);
+		return false;
+	}
+
+	shm->info.shmid = shmget(IPC_PRIVATE, img->bytes_per_line * img->height,
+				 IPC_CREAT|0600);
+	if (shm->info.shmid < 0) {
+		perror("st: shmget");
+		XDestroyImage(img);
+		return false;
+	}
+
+	shm->info.shmaddr = shmat(shm->info.shmid, NULL, 0);
+	if (shm->info.shmaddr == (void *) -1) {
+		perror("st: shmat");
+		shmctl(shm->info.shmid, IPC_RMID, NULL);
+		XDestroyImage(img);
+		return false;
+	}
+	img->data = shm->info.shmaddr;
+	shm->info.readOnly = False;
+
+	/* the extension can be there and still not work, e.g. remotely: */
+	shm_error = false;
+	handler = XSetErrorHandler(shm_errorhandler);
+	XShmAttach(xw->dpy, &shm->info);
+	XSync(xw->dpy, False);
+	XSetErrorHandler(handler);
+
+	/* goes away once we and the server are both done with it */
+	shmctl(shm->info.shmid, IPC_RMID, NULL);
+
+	if (shm_error) {
+		XDestroyImage(img);
+		shmdt(shm->info.shmaddr);
+		return false;
+	}
+
+	shm->img = img;
+
+	bg = shm_pixel(&xw->col[xw->term.reverse ? defaultfg : defaultbg]);
+	end = (uint32_t *) (img->data + img->bytes_per_line * img->height);
+	for (p = (uint32_t *) img->data; p < end; p++)
+		*p = bg;
+
+	return true;
+}
+
+/* Only the common case: 8 bits per channel, in 32 bit pixels */
+static bool shm_supported(struct st_window *xw)
+{
+	int depth = DefaultDepth(xw->dpy, xw->scr);
+
+	return XShmQueryExtension(xw->dpy) &&
+		(depth == 24 || depth == 32) &&
+		xw->vis->class == TrueColor &&
+		xw->vis->red_mask == 0xff0000 &&
+		xw->vis->green_mask == 0xff00 &&
+		xw->vis->blue_mask == 0xff;
+}
+
+static void shm_scroll(struct st_window *xw, unsigned src, unsigned dst,
+		       unsigned height)
+{
+	XImage *img = xw->shm.img;
+
+	shm_wait(xw);
+	memmove(img->data + dst * img->bytes_per_line,
+		img->data + src * img->bytes_per_line,
+		height * img->bytes_per_line);
+}
+
+/* dst = dst * (255 - c) / 255 + fg * c / 255, per channel */
+static void blend_scalar(uint32_t *dst, const unsigned char *cov,
+			 unsigned n, uint32_t fg)
+{
+	unsigned i, shift;
+
+	for (i = 0; i < n; i++) {
+		uint32_t d = dst[i], out = 0;
+		unsigned c = cov[i];
+
+		if (!c)
+			continue;
+		if (c == 255) {
+			dst[i] = fg;
+			continue;
+		}
+
+		for (shift = 0; shift < 32; shift += 8) {
+			unsigned v = ((d >> shift) & 0xff) * (255 - c) +
+				((fg >> shift) & 0xff) * c + 128;
+
+			out |= ((v + (v >> 8)) >> 8) << shift;
+		}
+
+		dst[i] = out;
+	}
+}
+
+#ifdef __SSE2__
+/* Four pixels at a time, as 16 bit channels: */
+static void blend(uint32_t *dst, const unsigned char *cov,
+		  unsigned n, uint32_t fg)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi16(255);
+	const __m128i half = _mm_set1_epi16(128);
+	const __m128i fg16 = _mm_unpacklo_epi8(_mm_set1_epi32(fg), zero);
+	unsigned i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		uint32_t c4;
+		__m128i c, d, lo, hi, clo, chi;
+
+		memcpy(&c4, cov + i, 4);
+		if (!c4)
+			continue;
+
+		/* each coverage byte, once for every channel of its pixel */
+		c = _mm_cvtsi32_si128(c4);
+		c = _mm_unpacklo_epi8(c, c);
+		c = _mm_unpacklo_epi16(c, c);
+		clo = _mm_unpacklo_epi8(c, zero);
+		chi = _mm_unpackhi_epi8(c, zero);
+
+		d = _mm_loadu_si128((__m128i *) (dst + i));
+		lo = _mm_unpacklo_epi8(d, zero);
+		hi = _mm_unpackhi_epi8(d, zero);
+
+		lo = _mm_add_epi16(_mm_add_epi16(
+				_mm_mullo_epi16(lo, _mm_sub_epi16(ones, clo)),
+				_mm_mullo_epi16(fg16, clo)), half);
+		hi = _mm_add_epi16(_mm_add_epi16(
+				_mm_mullo_epi16(hi, _mm_sub_epi16(ones, chi)),
+				_mm_mullo_epi16(fg16, chi)), half);
+
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+		_mm_storeu_si128((__m128i *) (dst + i),
+				 _mm_packus_epi16(lo, hi));
+	}
+
+	blend_scalar(dst + i, cov + i, n - i, fg);
+}
+#else
+#define blend			blend_scalar
+#endif
+
+static unsigned atlas_hash(XftFont *font, unsigned glyph)
+{
+	return ((uintptr_t) font >> 4 ^ glyph) * 2654435761U;
+}
+
+static struct st_atlas_entry *atlas_slot(struct st_shm *shm, XftFont *font,
+					 unsigned glyph)
+{
+	unsigned i = atlas_hash(font, glyph) & (shm->size - 1);
+
+	while (shm->table[i].font &&
+	       (shm->table[i].font != font || shm->table[i].glyph != glyph))
+		i = (i + 1) & (shm->size - 1);
+
+	return &shm->table[i];
+}
+
+/* Renders a glyph into the atlas, as 8 bit coverage: */
+static void atlas_render(struct st_shm *shm, struct st_atlas_entry *e)
+{
+	FT_Face face = XftLockFace(e->font);
+	FT_Bitmap *bm;
+	unsigned char *dst;
+	unsigned x, y;
+
+	e->width = e->height = 0;
+	if (!face)
+		return;
+
+	if (FT_Load_Glyph(face, e->glyph, FT_LOAD_RENDER))
+		goto out;
+
+	bm = &face->glyph->bitmap;
+	e->width	= bm->width;
+	e->height	= bm->rows;
+	e->left		= face->glyph->bitmap_left;
+	e->top		= face->glyph->bitmap_top;
+	e->offset	= shm->atlaslen;
+
+	if (shm->atlaslen + e->width * e->height > shm->atlassize) {
+		shm->atlassize = max(shm->atlassize * 2,
+				     shm->atlaslen + e->width * e->height);
+		shm->atlas = xrealloc(shm->atlas, shm->atlassize);
+	}
+
+	dst = shm->atlas + e->offset;
+	shm->atlaslen += e->width * e->height;
+
+	for (y = 0; y < e->height; y++) {
+		unsigned char *row = bm->buffer + (int) y * bm->pitch;
+
+		for (x = 0; x < e->width; x++)
+			switch (bm->pixel_mode) {
+			case FT_PIXEL_MODE_GRAY:
+				*dst++ = row[x];
+				break;
+			case FT_PIXEL_MODE_MONO:
+				*dst++ = row[x >> 3] & (0x80 >> (x & 7)) ? 255 : 0;
+				break;
+			case FT_PIXEL_MODE_BGRA:
+				*dst++ = row[x * 4 + 3];
+				break;
+			default:
+				*dst++ = 0;
+			}
+	}
+out:
+	XftUnlockFace(e->font);
+}
+
+static struct st_atlas_entry *atlas_glyph(struct st_shm *shm, XftFont *font,
+					  unsigned glyph)
+{
+	struct st_atlas_entry *e;
+
+	if (shm->size && (e = atlas_slot(shm, font, glyph))->font)
+		return e;
+
+	if ((shm->nr + 1) * 2 > shm->size) {
+		struct st_atlas_entry *old = shm->table;
+		unsigned oldsize = shm->size;
+
+		shm->size = max(shm->size * 2, 256U);
+		shm->table = xcalloc(shm->size, sizeof(*shm->table));
+
+		for (e = old; e < old + oldsize; e++)
+			if (e->font)
+				*atlas_slot(shm, e->font, e->glyph) = *e;
+
+		free(old);
+	}
+
+	e = atlas_slot(shm, font, glyph);
+	e->font = font;
+	e->glyph = glyph;
+	shm->nr++;
+
+	atlas_render(shm, e);
+	return e;
+}
+
+/* The glyphs are only good for the fonts they came from */
+static void atlas_clear(struct st_shm *shm)
+{
+	free(shm->table);
+	free(shm->atlas);
+	shm->table = NULL;
+	shm->atlas = NULL;
+	shm->size = shm->nr = 0;
+	shm->atlaslen = shm->atlassize = 0;
+}
+
+static void shm_fill(XImage *img, uint32_t pixel, XRectangle *r,
+		     unsigned y1, unsigned y2)
+{
+	unsigned x1 = min_t(unsigned, r->x, img->width);
+	unsigned x2 = min_t(unsigned, r->x + r->width, img->width);
+	unsigned x, y;
+
+	y1 = max(y1, (unsigned) r->y);
+	y2 = min(y2, (unsigned) r->y + r->height);
+
+	for (y = y1; y < y2; y++) {
+		uint32_t *p = (uint32_t *) (img->data + y * img->bytes_per_line);
+
+		for (x = x1; x < x2; x++)
+			p[x] = pixel;
+	}
+}
+
+static void shm_glyph(struct st_shm *shm, uint32_t pixel,
+		      XftGlyphFontSpec *spec, int y1, int y2)
+{
+	struct st_atlas_entry *e = atlas_slot(shm, spec->font, spec->glyph);
+	XImage *img = shm->img;
+	int x = spec->x + e->left, y = spec->y - e->top;
+	int x1 = max(x, 0), x2 = min(x + e->width, img->width);
+	int row;
+
+	if (x1 >= x2)
+		return;
+
+	y1 = max(y, y1);
+	y2 = min(y + e->height, y2);
+
+	for (row = y1; row < y2; row++)
+		blend((uint32_t *) (img->data + row * img->bytes_per_line) + x1,
+		      shm->atlas + e->offset + (row - y) * e->width + x1 - x,
+		      x2 - x1, pixel);
+}
+
+/* Composites everything that touches band @i, clipped to it */
+static void shm_band(struct st_window *xw, unsigned i)
+{
+	struct st_shm *shm = &xw->shm;
+	struct st_band *band = &shm->bands[i];
+	struct st_op *op;
+
+	for (op = band->ops; op < band->ops + band->nops; op++) {
+		struct st_batch *b = &xw->batch[op->batch];
+		uint32_t pixel = shm_pixel(&b->color);
+
+		switch (op->kind) {
+		case OP_RECT:
+			shm_fill(shm->img, pixel, &b->rects[op->idx],
+				 band->y1, band->y2);
+			break;
+		case OP_GLYPH:
+			shm_glyph(shm, pixel, &b->specs[op->idx],
+				  band->y1, band->y2);
+			break;
+		case OP_LINE:
+			shm_fill(shm->img, pixel, &b->lines[op->idx],
+				 band->y1, band->y2);
+			break;
+		}
+	}
+}
+
+static unsigned shm_band_of(struct st_window *xw, int y)
+{
+	if (y < (int) (xw->borderpx + xw->charsize.y))
+		return 0;
+
+	return min((y - xw->borderpx) / xw->charsize.y, xw->shm.nbands - 1);
+}
+
+/* Queues op on every band the pixel rows [y1, y2) fall in */
+static void shm_op(struct st_window *xw, struct st_op op, int y1, int y2)
+{
+	struct st_shm *shm = &xw->shm;
+	unsigned i;
+
+	y1 = max(y1, 0);
+	y2 = min(y2, shm->img->height);
+	if (y1 >= y2)
+		return;
+
+	for (i = shm_band_of(xw, y1); i <= shm_band_of(xw, y2 - 1); i++) {
+		struct st_band *band = &shm->bands[i];
+
+		if (!band->nops)
+			shm->work[shm->nwork++] = i;
+
+		band->ops = grow(band->ops, &band->size, band->nops,
+				 sizeof(*band->ops));
+		band->ops[band->nops++] = op;
+	}
+}
+
+/*
+ * Sorts the batches into bands, keeping the order things are drawn in within
+ * each band; also renders any glyphs the atlas doesn't have yet, so that the
+ * atlas is only read while compositing.
+ */
+static unsigned shm_bands(struct st_window *xw)
+{
+	struct st_shm *shm = &xw->shm;
+	unsigned nbands = max(xw->snap.size.y, 1U), nops = 0, i, j;
+	struct st_batch *b;
+
+	if (nbands > shm->bandsize) {
+		shm->bands = xrealloc(shm->bands, nbands * sizeof(*shm->bands));
+		memset(shm->bands + shm->bandsize, 0,
+		       (nbands - shm->bandsize) * sizeof(*shm->bands));
+		shm->work = xrealloc(shm->work, nbands * sizeof(*shm->work));
+		shm->bandsize = nbands;
+	}
+
+	shm->nbands = nbands;
+	shm->nwork = 0;
+	for (i = 0; i < nbands; i++) {
+		shm->bands[i].y1 = i ? xw->borderpx + i * xw->charsize.y : 0;
+		shm->bands[i].y2 = i + 1 < nbands
+			? xw->borderpx + (i + 1) * xw->charsize.y
+			: shm->img->height;
+		shm->bands[i].nops = 0;
+	}
+
+	for (b = xw->batch; b < xw->batch + xw->nbatch; b++)
+		for (j = 0; j < b->nrects; j++)
+			shm_op(xw, (struct st_op) { OP_RECT, b - xw->batch, j },
+			       b->rects[j].y, b->rects[j].y + b->rects[j].height);
+
+	for (b = xw->batch; b < xw->batch + xw->nbatch; b++)
+		for (j = 0; j < b->nspecs; j++) {
+			XftGlyphFontSpec *spec = &b->specs[j];
+			struct st_atlas_entry *e =
+				atlas_glyph(shm, spec->font, spec->glyph);
+
+			shm_op(xw, (struct st_op) { OP_GLYPH, b - xw->batch, j },
+			       spec->y - e->top, spec->y - e->top + e->height);
+		}
+
+	for (b = xw->batch; b < xw->batch + xw->nbatch; b++)
+		for (j = 0; j < b->nlines; j++)
+			shm_op(xw, (struct st_op) { OP_LINE, b - xw->batch, j },
+			       b->lines[j].y, b->lines[j].y + b->lines[j].height);
+
+	for (i = 0; i < shm->nwork; i++)
+		nops += shm->bands[shm->work[i]].nops;
+
+	return nops;
+}
+
+/* Takes the next band off the front of a queue: */
+static bool queue_pop(uint64_t *queue, unsigned *band)
+{
+	uint64_t old = __atomic_load_n(queue, __ATOMIC_ACQUIRE), new;
+
+	do {
+		unsigned next = old >> 32, end = old;
+
+		if (next >= end)
+			return false;
+
+		*band = next;
+		new = (uint64_t) (next + 1) << 32 | end;
+	} while (!__atomic_compare_exchange_n(queue, &old, new, true,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+	return true;
+}
+
+/* ...or off the back, when stealing: */
+static bool queue_steal(uint64_t *queue, unsigned *band)
+{
+	uint64_t old = __atomic_load_n(queue, __ATOMIC_ACQUIRE), new;
+
+	do {
+		unsigned next = old >> 32, end = old;
+
+		if (next >= end)
+			return false;
+
+		*band = end - 1;
+		new = (uint64_t) next << 32 | (end - 1);
+	} while (!__atomic_compare_exchange_n(queue, &old, new, true,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+	return true;
+}
+
+static void pool_work(struct st_worker *w)
+{
+	struct st_pool *pool = &w->xw->shm.pool;
+	unsigned i, band;
+
+	while (1) {
+		if (queue_pop(&w->queue, &band))
+			goto draw;
+
+		for (i = 1; i < pool->active; i++)
+			if (queue_steal(&pool->workers[(w->idx + i) %
+					pool->active].queue, &band))
+				goto draw;
+
+		return;
+draw:
+		shm_band(w->xw, w->xw->shm.work[band]);
+	}
+}
+
+static void *pool_thread(void *arg)
+{
+	struct st_worker *w = arg;
+	struct st_pool *pool = &w->xw->shm.pool;
+	unsigned generation = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->generation == generation)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		generation = pool->generation;
+		if (w->idx >= pool->active)
+			continue;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_work(w);
+
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->running)
+			pthread_cond_signal(&pool->done);
+	}
+
+	return NULL;
+}
+
+/* Composites shm->work on every thread, returns when all of it is done */
+static void pool_run(struct st_window *xw)
+{
+	struct st_shm *shm = &xw->shm;
+	struct st_pool *pool = &shm->pool;
+	unsigned i;
+
+	for (i = 0; i < pool->active; i++)
+		pool->workers[i].queue =
+			(uint64_t) (shm->nwork * i / pool->active) << 32 |
+			shm->nwork * (i + 1) / pool->active;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->generation++;
+	pool->running = pool->active - 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool_work(&pool->workers[0]);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_init(struct st_window *xw, unsigned nthreads)
+{
+	struct st_pool *pool = &xw->shm.pool;
+	sigset_t set, old;
+	pthread_t thread;
+	unsigned i;
+
+	pool->nworkers = pool->active = max(nthreads, 1U);
+	pool->workers = xcalloc(pool->nworkers, sizeof(*pool->workers));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	/* SIGUSR1 is for the main thread's pselect(), threads inherit the mask */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < pool->nworkers; i++) {
+		pool->workers[i].xw = xw;
+		pool->workers[i].idx = i;
+
+		if (i && pthread_create(&thread, NULL, pool_thread,
+					&pool->workers[i]))
+			die("st: can't create render thread\n");
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* below this many ops, waking the other threads costs more than it saves */
+#define SHM_PARALLEL_MIN	512
+
+/*
+ * Every pixel is composited by one thread, with the same ops in the same
+ * order however many threads there are, so the frame comes out the same:
+ */
+static void shm_flush(struct st_window *xw)
+{
+	struct st_shm *shm = &xw->shm;
+	unsigned i, nops;
+
+	shm_wait(xw);
+	nops = shm_bands(xw);
+
+	if (shm->pool.active > 1 && nops >= SHM_PARALLEL_MIN) {
+		pool_run(xw);
+	} else {
+		for (i = 0; i < shm->nwork; i++)
+			shm_band(xw, shm->work[i]);
+	}
+}
+
+static void shm_copy(struct st_window *xw, XRectangle r)
+{
+	XShmPutImage(xw->dpy, xw->win, xw->gc, xw->shm.img,
+		     r.x, r.y, r.x, r.y, r.width, r.height, False);
+	xw->shm.busy = true;
+}
+
+static const struct st_backend shm_backend = {
+	.name	= "shm",
+	.resize	= shm_resize,
+	.scroll	= shm_scroll,
+	.flush	= shm_flush,
+	.copy	= shm_copy,
+};
+
+static void batch_flush(struct st_window *xw)
+{
+	xw->backend->flush(xw);
+	xw->nbatch = 0;
+}
+
 static void xclear(struct st_window *xw, XftColor *color,
 		   struct coord pos, unsigned charlen,
 		   bool clear_border)
@@ -341,57 +1608,203 @@ static void xclear(struct st_window *xw, XftColor *color,
 			x1 = 0;
 		}
 
-		if (pos.x + charlen == xw->term.size.x)
-			x2 = xw->winsize.x - x1;
+		if (pos.x + charlen == xw->snap.size.x)
+			x2 = xw->winsize.x - x1;
+
+		if (!pos.y) {
+			y2 += y1;
+			y1 = 0;
+		}
+
+		if (pos.y + 1 == xw->snap.size.y)
+			y2 = xw->winsize.y - y1;
+	}
+
+	/* Clean up the region we want to draw to. */
+	batch_rect(xw, color, x1, y1, x2, y2);
+}
+
+static unsigned short *rgbcache_bucket(struct st_rgbcache *c, uint32_t rgb)
+{
+	return &c->buckets[(rgb * 2654435761U) >> 24];
+}
+
+static void rgbcache_evict(struct st_window *xw, struct st_rgbcache_entry *e)
+{
+	struct st_rgbcache *c = &xw->rgbcache;
+	unsigned short *p = rgbcache_bucket(c, e->rgb);
+	unsigned i = e - c->entries + 1;
+
+	while (*p != i)
+		p = &c->entries[*p - 1].next;
+	*p = e->next;
+
+	if (e->frame == c->frame) {
+		c->dead = grow(c->dead, &c->deadsize, c->ndead,
+			       sizeof(*c->dead));
+		c->dead[c->ndead++] = e->color;
+	} else {
+		XftColorFree(xw->dpy, xw->vis, xw->cmap, &e->color);
+	}
+
+	e->rgb = 0;
+}
+
+static XftColor *rgbcache_get(struct st_window *xw, uint32_t rgb)
+{
+	struct st_rgbcache *c = &xw->rgbcache;
+	struct st_rgbcache_entry *e;
+	unsigned short *bucket = rgbcache_bucket(c, rgb);
+	XRenderColor color = {
+		.red	= ((rgb >> 16) & 0xff) * 0x101,
+		.green	= ((rgb >> 8) & 0xff) * 0x101,
+		.blue	= (rgb & 0xff) * 0x101,
+		.alpha	= 0xffff,
+	};
+	unsigned i;
+
+	for (i = *bucket; i; i = e->next) {
+		e = &c->entries[i - 1];
+		if (e->rgb == rgb) {
+			c->hits++;
+			goto out;
+		}
+	}
+
+	c->misses++;
+
+	/* unused entries have never been used, so they go first */
+	e = c->entries;
+	for (i = 1; i < RGBCACHE_SIZ; i++)
+		if (c->entries[i].used < e->used)
+			e = &c->entries[i];
+
+	if (e->rgb)
+		rgbcache_evict(xw, e);
+
+	if (!XftColorAllocValue(xw->dpy, xw->vis, xw->cmap, &color, &e->color))
+		return &xw->col[defaultfg];
+
+	e->rgb = rgb;
+	e->next = *bucket;
+	*bucket = e - c->entries + 1;
+out:
+	e->used = ++c->clock;
+	e->frame = c->frame;
+	return &e->color;
+}
+
+/* Colors evicted last frame aren't in use any more */
+static void rgbcache_frame(struct st_window *xw)
+{
+	struct st_rgbcache *c = &xw->rgbcache;
+
+	while (c->ndead)
+		XftColorFree(xw->dpy, xw->vis, xw->cmap, &c->dead[--c->ndead]);
+
+	c->frame++;
+}
+
+static XftColor *xcolor(struct st_window *xw, unsigned color, bool reverse)
+{
+	uint32_t rgb;
+
+	if (color < TRUECOLOR_BASE)
+		return reverse ? &xw->rcol[color] : &xw->col[color];
+
+	rgb = xw->snap.truecolor[color - TRUECOLOR_BASE];
+	return rgbcache_get(xw, reverse ? rgb ^ 0xffffff : rgb);
+}
+
+static struct st_glyphcache_entry *glyphcache_slot(struct st_glyphcache *gc,
+						  unsigned key)
+{
+	unsigned i = (key * 2654435761U) & (gc->size - 1);
+
+	while (gc->table[i].key && gc->table[i].key != key)
+		i = (i + 1) & (gc->size - 1);
+
+	return &gc->table[i];
+}
+
+static struct st_glyphcache_entry *glyphcache_find(struct st_glyphcache *gc,
+						  unsigned key)
+{
+	struct st_glyphcache_entry *e;
+
+	if (!gc->size)
+		return NULL;
+
+	e = glyphcache_slot(gc, key + 1);
+	return e->key ? e : NULL;
+}
+
+static struct st_glyphcache_entry *glyphcache_add(struct st_glyphcache *gc,
+						 unsigned key, unsigned glyph,
+						 XftFont *font)
+{
+	struct st_glyphcache_entry *e;
+
+	if ((gc->nr + 1) * 2 > gc->size) {
+		struct st_glyphcache_entry *old = gc->table;
+		unsigned oldsize = gc->size;
 
-		if (!pos.y) {
-			y2 += y1;
-			y1 = 0;
-		}
+		gc->size = max(gc->size * 2, 256U);
+		gc->table = xcalloc(gc->size, sizeof(*gc->table));
 
-		if (pos.y + 1 == xw->term.size.y)
-			y2 = xw->winsize.y - y1;
+		for (e = old; e < old + oldsize; e++)
+			if (e->key)
+				*glyphcache_slot(gc, e->key) = *e;
+
+		free(old);
 	}
 
-	/* Clean up the region we want to draw to. */
-	XftDrawRect(xw->draw, color, x1, y1, x2, y2);
+	e = glyphcache_slot(gc, key + 1);
+	*e = (struct st_glyphcache_entry) {
+		.key = key + 1, .glyph = glyph, .font = font,
+	};
+	gc->nr++;
+
+	return e;
 }
 
-static XftColor *reverse_color(struct st_window *xw, XftColor *color,
-			       XftColor *def, XftColor *defreverse,
-			       XftColor *reverse)
+static void glyphcache_free(struct st_glyphcache *gc)
 {
-	if (color == def) {
-		return defreverse;
-	} else {
-		XRenderColor t;
+	free(gc->table);
+	memset(gc, 0, sizeof(*gc));
+}
+
+static void fontcache_clear(struct st_window *xw)
+{
+	struct st_fontcache *fc = &xw->fontcache;
 
-		t.red = ~color->color.red;
-		t.green = ~color->color.green;
-		t.blue = ~color->color.blue;
-		t.alpha = color->color.alpha;
-		XftColorAllocValue(xw->dpy, xw->vis, xw->cmap, &t, reverse);
+	while (fc->nfonts)
+		XftFontClose(xw->dpy, fc->fonts[--fc->nfonts]);
 
-		return reverse;
-	}
+	free(fc->fonts);
+	fc->fonts = NULL;
+	glyphcache_free(&fc->map);
 }
 
 static XftFont *find_font(struct st_window *xw, struct st_font *font,
-			  unsigned flags, long u8char)
+			  unsigned flags, unsigned ucs)
 {
+	struct st_fontcache *fc = &xw->fontcache;
+	struct st_glyphcache_entry *e;
+	unsigned key = ucs << 2 | flags;
 	FcFontSet *fcsets[] = { font->set };
 	FcPattern *fcpattern, *fontpattern;
 	FcCharSet *fccharset;
 	FcResult fcres;
-	XftFont *xfont;
-	struct st_fontcache *fc;
+	XftFont *xfont = NULL;
+	unsigned i;
 
-	/* Search the font cache. */
-	for (fc = xw->fontcache;
-	     fc < xw->fontcache + ARRAY_SIZE(xw->fontcache) && fc->font;
-	     fc++)
-		if (fc->flags == flags && fc->c == u8char)
-			return fc->font;
+	if ((e = glyphcache_find(&fc->map, key))) {
+		fc->hits++;
+		return e->font;
+	}
+
+	fc->misses++;
 
 	/*
 	 * Nothing was found in the cache. Now use
@@ -401,7 +1814,7 @@ static XftFont *find_font(struct st_window *xw, struct st_font *font,
 	fcpattern = FcPatternDuplicate(font->pattern);
 	fccharset = FcCharSetCreate();
 
-	FcCharSetAddChar(fccharset, u8char);
+	FcCharSetAddChar(fccharset, ucs);
 	FcPatternAddCharSet(fcpattern, FC_CHARSET,
 			    fccharset);
 	FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
@@ -410,82 +1823,100 @@ static XftFont *find_font(struct st_window *xw, struct st_font *font,
 	FcDefaultSubstitute(fcpattern);
 
 	fontpattern = FcFontSetMatch(NULL, fcsets, 1, fcpattern, &fcres);
+	if (fontpattern && !(xfont = XftFontOpenPattern(xw->dpy, fontpattern)))
+		FcPatternDestroy(fontpattern);
 
-	xfont = XftFontOpenPattern(xw->dpy, fontpattern);
+	FcCharSetDestroy(fccharset);
+	FcPatternDestroy(fcpattern);
 
-	fc = &xw->fontcache[ARRAY_SIZE(xw->fontcache) - 1];
-	if (fc->font)
-		XftFontClose(xw->dpy, fc->font);
+	/* the best match may not have it either, remember that too */
+	if (xfont && !XftCharIndex(xw->dpy, xfont, ucs)) {
+		XftFontClose(xw->dpy, xfont);
+		xfont = NULL;
+	}
 
-	fc = xw->fontcache;
-	memmove(fc + 1, fc,
-		(ARRAY_SIZE(xw->fontcache) - 1) * sizeof(*fc));
+	if (xfont) {
+		/* Xft hands out the same XftFont for the same font */
+		for (i = 0; i < fc->nfonts; i++)
+			if (fc->fonts[i] == xfont) {
+				XftFontClose(xw->dpy, xfont);
+				break;
+			}
 
-	fc->font = xfont;
-	fc->c = u8char;
-	fc->flags = flags;
+		if (i == fc->nfonts) {
+			fc->fonts = xrealloc(fc->fonts, (fc->nfonts + 1) *
+					     sizeof(*fc->fonts));
+			fc->fonts[fc->nfonts++] = xfont;
+		}
+	}
 
-	FcCharSetDestroy(fccharset);
-	FcPatternDestroy(fcpattern);
+	glyphcache_add(&fc->map, key, 0, xfont);
 
 	return xfont;
 }
 
+/*
+ * The font and glyph that draw @ucs in @font: mostly the glyph in font->match,
+ * else the fallback font's, else the replacement character.
+ */
+static struct st_glyphcache_entry *font_glyph(struct st_window *xw,
+					      struct st_font *font,
+					      unsigned flags, unsigned ucs)
+{
+	struct st_glyphcache_entry *e;
+	XftFont *xfont = font->match;
+	unsigned glyph;
+
+	if (ucs < GLYPHCACHE_DIRECT) {
+		e = &font->direct[ucs];
+		if (e->font)
+			return e;
+	} else if ((e = glyphcache_find(&font->glyphs, ucs))) {
+		return e;
+	}
+
+	glyph = XftCharIndex(xw->dpy, xfont, ucs);
+	if (!glyph) {
+		xfont = find_font(xw, font, flags, ucs);
+		if (xfont) {
+			glyph = XftCharIndex(xw->dpy, xfont, ucs);
+		} else {
+			xfont = font->match;
+			glyph = XftCharIndex(xw->dpy, xfont, 0xFFFD) ?:
+				XftCharIndex(xw->dpy, xfont, ' ');
+		}
+	}
+
+	if (ucs < GLYPHCACHE_DIRECT) {
+		e->glyph = glyph;
+		e->font = xfont;
+		return e;
+	}
+
+	return glyphcache_add(&font->glyphs, ucs, glyph, xfont);
+}
+
 static void do_xdraw_glyphs(struct st_window *xw, struct coord pos,
 			    struct st_glyph base, struct st_glyph *glyphs,
 			    unsigned nglyphs, struct st_font *font,
 			    unsigned frcflags, XftColor *fg)
 {
-	unsigned winx = xw->borderpx + pos.x * xw->charsize.x, xp = winx;
+	unsigned winx = xw->borderpx + pos.x * xw->charsize.x;
 	unsigned winy = xw->borderpx + pos.y * xw->charsize.y;
-	unsigned xglyphs[1024], nxglyphs = 0, i = 0, ucs;
-
-	while (i < nglyphs) {
-		bool found = true;
-
-		while (i < nglyphs && nxglyphs < ARRAY_SIZE(xglyphs)) {
-			ucs = glyphs[i].c ?: ' ';
-			xglyphs[nxglyphs] = XftCharIndex(xw->dpy, font->match, ucs);
-			if (!xglyphs[nxglyphs]) {
-				found = false;
-				break;
-			}
-			nxglyphs++;
-			i++;
-		}
-
-		if (nxglyphs) {
-			XftDrawGlyphs(xw->draw, fg, font->match, xp,
-				      winy + font->match->ascent,
-				      xglyphs, nxglyphs);
-			xp += xw->charsize.x * nxglyphs;
-			nxglyphs = 0;
-		}
-
-		if (!found) {
-			unsigned glyph;
-			XftFont *xfont;
-
-			xfont = find_font(xw, font, frcflags, ucs);
-			if (xfont) {
-				glyph = XftCharIndex(xw->dpy, xfont, ucs);
-			} else {
-				xfont = font->match;
-				glyph = XftCharIndex(xw->dpy, xfont, 0xFFFD) ?:
-					XftCharIndex(xw->dpy, xfont, ' ');
-			}
+	unsigned i;
 
-			XftDrawGlyphs(xw->draw, fg, xfont, xp,
-				      winy + xfont->ascent, &glyph, 1);
+	for (i = 0; i < nglyphs; i++) {
+		struct st_glyphcache_entry *e =
+			font_glyph(xw, font, frcflags, glyphs[i].c ?: ' ');
 
-			xp += xw->charsize.x;
-			i++;
-		}
+		batch_glyph(xw, fg, e->font, e->glyph,
+			    winx + i * xw->charsize.x,
+			    winy + e->font->ascent);
 	}
 
 	if (base.underline)
-		XftDrawRect(xw->draw, fg, winx, winy + font->match->ascent + 1,
-			    nglyphs * xw->charsize.x, 1);
+		batch_line(xw, fg, winx, winy + font->match->ascent + 1,
+			   nglyphs * xw->charsize.x, 1);
 }
 
 static void xdraw_glyphs(struct st_window *xw, struct coord pos,
@@ -494,27 +1925,12 @@ static void xdraw_glyphs(struct st_window *xw, struct coord pos,
 {
 	unsigned frcflags = FRC_NORMAL;
 	struct st_font *font = &xw->font;
-	XftColor *fg = &xw->col[base.fg];
-	XftColor *bg = &xw->col[base.bg];
-	XftColor revfg, revbg;
+	unsigned fgcolor = base.fg;
+	XftColor *fg, *bg;
 
 	if (base.bold) {
-		if (BETWEEN(base.fg, 0, 7)) {
-			/* basic system colors */
-			fg = &xw->col[base.fg + 8];
-		} else if (BETWEEN(base.fg, 16, 195)) {
-			/* 256 colors */
-			fg = &xw->col[base.fg + 36];
-		} else if (BETWEEN(base.fg, 232, 251)) {
-			/* greyscale */
-			fg = &xw->col[base.fg + 4];
-		}
-		/*
-		 * Those ranges will not be brightened:
-		 *      8 - 15 – bright system colors
-		 *      196 - 231 – highest 256 color cube
-		 *      252 - 255 – brightest colors in greyscale
-		 */
+		if (fgcolor < TRUECOLOR_BASE)
+			fgcolor = xw->bold[fgcolor];
 		font = &xw->bfont;
 		frcflags = FRC_BOLD;
 	}
@@ -528,13 +1944,8 @@ static void xdraw_glyphs(struct st_window *xw, struct coord pos,
 		frcflags = FRC_ITALICBOLD;
 	}
 
-	if (xw->term.reverse) {
-		fg = reverse_color(xw, fg, &xw->col[defaultfg],
-				   &xw->col[defaultbg], &revfg);
-
-		bg = reverse_color(xw, bg, &xw->col[defaultbg],
-				   &xw->col[defaultfg], &revbg);
-	}
+	fg = xcolor(xw, fgcolor, xw->snap.reverse);
+	bg = xcolor(xw, base.bg, xw->snap.reverse);
 
 	if (base.reverse)
 		swap(bg, fg);
@@ -545,17 +1956,19 @@ static void xdraw_glyphs(struct st_window *xw, struct coord pos,
 
 static void xdrawcursor(struct st_window *xw)
 {
+	struct st_snapshot *snap = &xw->snap;
+	struct coord pos = snap->cursor;
 	struct st_glyph g;
 
-	if (xw->term.hide)
+	if (snap->hide || pos.y >= snap->size.y)
 		return;
 
-	g.c = term_pos(&xw->term, xw->term.c.pos)->c;
+	g.c = snap->line[pos.y][pos.x].c;
 	g.cmp = 0;
 	g.fg = defaultbg;
 	g.bg = defaultcs;
 
-	g.reverse = xw->term.reverse;
+	g.reverse = snap->reverse;
 	if (g.reverse) {
 		unsigned t = g.fg;
 		g.fg = g.bg;
@@ -563,61 +1976,190 @@ static void xdrawcursor(struct st_window *xw)
 	}
 
 	if (xw->focused) {
-		xdraw_glyphs(xw, xw->term.c.pos, g, &g, 1, false);
+		xdraw_glyphs(xw, pos, g, &g, 1, false);
 	} else {
-		XSetForeground(xw->dpy, xw->gc, xw->col[defaultcs].pixel);
-		XDrawRectangle(xw->dpy, xw->buf, xw->gc,
-			       xw->borderpx + xw->term.c.pos.x * xw->charsize.x,
-			       xw->borderpx + xw->term.c.pos.y * xw->charsize.y,
-			       xw->charsize.x, xw->charsize.y);
+		/* stay inside the cell, so repainting the cell erases it */
+		XftColor *cs = &xw->col[defaultcs];
+		unsigned x = xw->borderpx + pos.x * xw->charsize.x;
+		unsigned y = xw->borderpx + pos.y * xw->charsize.y;
+
+		batch_rect(xw, cs, x, y, xw->charsize.x, 1);
+		batch_rect(xw, cs, x, y + xw->charsize.y - 1, xw->charsize.x, 1);
+		batch_rect(xw, cs, x, y, 1, xw->charsize.y);
+		batch_rect(xw, cs, x + xw->charsize.x - 1, y, 1, xw->charsize.y);
 	}
+
+	xw->cursor = pos;
 }
 
-static struct st_glyph sel_glyph(struct st_window *xw, unsigned x, unsigned y)
+static void damage_cell(struct st_snapshot *snap, struct coord pos)
 {
-	struct st_glyph ret = xw->term.line[y][x];
+	struct damage *d = &snap->damage[pos.y];
 
-	if (term_selected(&xw->term.sel, x, y))
-		ret.reverse ^= 1;
+	d->x1 = min(d->x1, pos.x);
+	d->x2 = max(d->x2, pos.x + 1);
+}
 
-	return ret;
+/*
+ * Window area covered by cells [x1, x2) of a row, including the border when
+ * the cells touch it - matches what xclear() paints with clear_border set:
+ */
+static XRectangle cell_rect(struct st_window *xw, unsigned y,
+			    unsigned x1, unsigned x2)
+{
+	unsigned left	= x1 ? xw->borderpx + x1 * xw->charsize.x : 0;
+	unsigned right	= x2 < xw->snap.size.x
+		? xw->borderpx + x2 * xw->charsize.x : xw->winsize.x;
+	unsigned top	= y ? xw->borderpx + y * xw->charsize.y : 0;
+	unsigned bottom	= y + 1 < xw->snap.size.y
+		? xw->borderpx + (y + 1) * xw->charsize.y : xw->winsize.y;
+
+	return (XRectangle) {
+		.x = left, .y = top,
+		.width = right - left, .height = bottom - top,
+	};
+}
+
+static void copy_rect(struct st_window *xw, XRectangle r)
+{
+	if (r.width && r.height)
+		xw->backend->copy(xw, r);
+}
+
+/*
+ * Replay the scrolls logged since the last frame by moving what's already in
+ * xw->buf; the lines scrolled in are damaged and get repainted after this:
+ */
+static void draw_scrolls(struct st_window *xw, bool *moved)
+{
+	struct st_snapshot *snap = &xw->snap;
+	struct scroll *s;
+
+	for (s = snap->scrolls; s < snap->scrolls + snap->nscrolls; s++) {
+		unsigned height = s->bot - s->top + 1;
+		unsigned n = abs(s->n);
+		unsigned src = s->n > 0 ? s->top + n : s->top;
+		unsigned dst = s->n > 0 ? s->top : s->top + n;
+		int cursor = xw->cursor.y;
+
+		if (n >= height)
+			continue;
+
+		xw->backend->scroll(xw, xw->borderpx + src * xw->charsize.y,
+				    xw->borderpx + dst * xw->charsize.y,
+				    (height - n) * xw->charsize.y);
+
+		memset(moved + s->top, 1, height * sizeof(*moved));
+
+		/* the old cursor image moved too: */
+		if (BETWEEN(cursor, (int) s->top, (int) s->bot)) {
+			cursor -= s->n;
+			xw->cursor.y = BETWEEN(cursor, (int) s->top, (int) s->bot)
+				? cursor : ~0U;
+		}
+	}
+
+	snap->nscrolls = 0;
 }
 
 static void draw(struct st_window *xw)
 {
+	struct st_snapshot *snap = &xw->snap;
+	XRectangle r, copies[snap->size.y + 1];
+	unsigned i, ncopies = 0;
+	unsigned long requests = NextRequest(xw->dpy);
+	struct timeval start = monotonic_gettime(), drawn, flushed;
 	struct coord pos;
+	bool moved[snap->size.y];
+
+	copies[0] = (XRectangle) { 0 };
+
+	rgbcache_frame(xw);
+	memset(moved, 0, sizeof(moved));
+	draw_scrolls(xw, moved);
+
+	/* the cursor's old and new cells need repainting: */
+	if (xw->cursor.x < snap->size.x &&
+	    xw->cursor.y < snap->size.y)
+		damage_cell(snap, xw->cursor);
+	if (snap->cursor.y < snap->size.y)
+		damage_cell(snap, snap->cursor);
 
-	xw->term.dirty = false;
+	for (pos.y = 0; pos.y < snap->size.y; pos.y++) {
+		struct st_glyph *line = snap->line[pos.y];
+		struct damage d = snap->damage[pos.y];
 
-	for (pos.y = 0; pos.y < xw->term.size.y; pos.y++) {
-		pos.x = 0;
+		if (d.x1 >= d.x2 && !moved[pos.y])
+			continue;
+
+		snap->damage[pos.y] = NODAMAGE;
+		d.x2 = min(d.x2, snap->size.x);
+		xw->cells += moved[pos.y] ? snap->size.x : d.x2 - d.x1;
 
-		while (pos.x < xw->term.size.x) {
+		pos.x = d.x1;
+		while (pos.x < d.x2) {
 			unsigned x2 = pos.x + 1;
-			struct st_glyph base = sel_glyph(xw, pos.x, pos.y);
+			struct st_glyph base = line[pos.x];
 
-			while (x2 < xw->term.size.x &&
-			       base.cmp == sel_glyph(xw, x2, pos.y).cmp)
+			while (x2 < d.x2 && base.cmp == line[x2].cmp)
 				x2++;
 
-			xdraw_glyphs(xw, pos, base,
-				     term_pos(&xw->term, pos), x2 - pos.x,
-				     true);
+			xdraw_glyphs(xw, pos, base, line + pos.x,
+				     x2 - pos.x, true);
 			pos.x = x2;
 		}
+
+		/* merge vertically adjacent rectangles of the same width: */
+		r = moved[pos.y]
+			? cell_rect(xw, pos.y, 0, snap->size.x)
+			: cell_rect(xw, pos.y, d.x1, d.x2);
+		if (r.x == copies[ncopies].x &&
+		    r.width == copies[ncopies].width &&
+		    r.y == copies[ncopies].y + copies[ncopies].height)
+			copies[ncopies].height += r.height;
+		else
+			copies[++ncopies] = r;
 	}
 
+	/* the cursor goes over the cells under it, so after them: */
+	batch_flush(xw);
 	xdrawcursor(xw);
+	batch_flush(xw);
+
+	for (i = 0; i <= ncopies; i++)
+		copy_rect(xw, copies[i]);
 
-	XCopyArea(xw->dpy, xw->buf, xw->win, xw->gc,
-		  0, 0, xw->winsize.x, xw->winsize.y, 0, 0);
 	XSetForeground(xw->dpy, xw->gc,
-		       xw->col[xw->term.reverse ? defaultfg : defaultbg].pixel);
+		       xw->col[snap->reverse ? defaultfg : defaultbg].pixel);
+
+	drawn = monotonic_gettime();
 	XFlush(xw->dpy);
+	flushed = monotonic_gettime();
+
+	timersub(&flushed, &drawn, &flushed);
+	timersub(&drawn, &start, &drawn);
+
+	xw->frames++;
+	xw->draw_us += drawn.tv_sec * 1000000 + drawn.tv_usec;
+	xw->flush_us += flushed.tv_sec * 1000000 + flushed.tv_usec;
+
+	if (xw->logframes) {
+		fprintf(stderr, "frame: %lu requests, %ld us drawing, %ld us flushing\n",
+			NextRequest(xw->dpy) - requests,
+			drawn.tv_sec * 1000000 + drawn.tv_usec,
+			flushed.tv_sec * 1000000 + flushed.tv_usec);
+	}
 }
 
 /* Keyboard input */
 
+/* Whatever the key did should be on screen as soon as possible: */
+static void keyinput(struct st_window *xw)
+{
+	xw->lastkey = monotonic_gettime();
+	xw->echo_pending = true;
+}
+
 static char *kmap(struct st_term *term, KeySym k, unsigned state)
 {
 	unsigned mask;
@@ -684,6 +2226,7 @@ static void kpress(struct st_window *xw, XEvent *ev)
 	for (bp = shortcuts; bp < shortcuts + ARRAY_SIZE(shortcuts); bp++) {
 		if (ksym == bp->keysym && match(bp->mod, e->state)) {
 			bp->func(xw, &(bp->arg));
+			keyinput(xw);
 			return;
 		}
 	}
@@ -704,6 +2247,10 @@ static void kpress(struct st_window *xw, XEvent *ev)
 		len = cp - buf + len;
 	}
 
+	/* typing brings the view back to what's being typed at */
+	term_scroll_view(&xw->term, -xw->term.scroll);
+
+	keyinput(xw);
 	ttywrite(&xw->term, buf, len);
 	if (xw->term.echo)
 		term_echo(&xw->term, buf, len);
@@ -721,15 +2268,27 @@ static struct coord mouse_pos(struct st_window *xw, XEvent *ev)
 	};
 }
 
+/* X mouse events, in term_mousereport()'s terms */
+static void mousereport(struct st_window *xw, XEvent *ev)
+{
+	unsigned state = ev->xbutton.state;
+
+	term_mousereport(&xw->term, mouse_pos(xw, ev),
+			 ev->type == MotionNotify ? MOUSE_MOTION :
+			 ev->type == ButtonRelease ? MOUSE_RELEASE :
+			 MOUSE_PRESS,
+			 ev->xbutton.button,
+			 (state & ShiftMask ? MOUSE_SHIFT : 0) |
+			 (state & Mod4Mask ? MOUSE_META : 0) |
+			 (state & ControlMask ? MOUSE_CTRL : 0));
+}
+
 static void bpress(struct st_window *xw, XEvent *ev)
 {
 	struct st_term *term = &xw->term;
 
 	if (term->mousebtn || term->mousemotion) {
-		term_mousereport(term, mouse_pos(xw, ev),
-				 ev->xbutton.type,
-				 ev->xbutton.button,
-				 ev->xbutton.state);
+		mousereport(xw, ev);
 		return;
 	}
 
@@ -768,10 +2327,7 @@ static void brelease(struct st_window *xw, XEvent *ev)
 	struct st_selection *sel = &term->sel;
 
 	if (term->mousebtn || term->mousemotion) {
-		term_mousereport(term, mouse_pos(xw, ev),
-				 ev->xbutton.type,
-				 ev->xbutton.button,
-				 ev->xbutton.state);
+		mousereport(xw, ev);
 		return;
 	}
 
@@ -799,7 +2355,7 @@ static void brelease(struct st_window *xw, XEvent *ev)
 			 xw->doubleclicktimeout)
 			term_sel_stop(term);
 
-		if (sel->clip)
+		if (sel->type != SEL_NONE)
 			xsetsel(xw);
 		break;
 	case Button2:
@@ -813,10 +2369,7 @@ static void bmotion(struct st_window *xw, XEvent *ev)
 	struct st_term *term = &xw->term;
 
 	if (term->mousebtn || term->mousemotion) {
-		term_mousereport(term, mouse_pos(xw, ev),
-				 ev->xbutton.type,
-				 ev->xbutton.button,
-				 ev->xbutton.state);
+		mousereport(xw, ev);
 		return;
 	}
 
@@ -829,17 +2382,17 @@ static void bmotion(struct st_window *xw, XEvent *ev)
 
 static void xresize(struct st_window *xw, int col, int row)
 {
-	XFreePixmap(xw->dpy, xw->buf);
-	xw->buf = XCreatePixmap(xw->dpy, xw->win,
-				xw->winsize.x, xw->winsize.y,
-				DefaultDepth(xw->dpy, xw->scr));
-	XSetForeground(xw->dpy, xw->gc,
-		       xw->col[xw->term.reverse ? defaultfg : defaultbg].
-		       pixel);
-	XFillRectangle(xw->dpy, xw->buf, xw->gc, 0, 0,
-		       xw->winsize.x, xw->winsize.y);
+	if (xw->backend->resize(xw))
+		return;
 
-	XftDrawChange(xw->draw, xw->buf);
+	if (xw->backend == &xft_backend)
+		die("st: can't resize the %s buffer\n", xw->backend->name);
+
+	/* shm_resize() has already let go of the old image */
+	fprintf(stderr, "st: MIT-SHM resize failed, using Xft\n");
+	xw->backend = &xft_backend;
+	xft_resize(xw);
+	term_damage_all(&xw->term);
 }
 
 static void cresize(struct st_window *xw, unsigned width, unsigned height)
@@ -873,6 +2426,23 @@ static void resize(struct st_window *xw, XEvent *ev)
 
 /* Start of st */
 
+static unsigned bold_color(unsigned i)
+{
+	if (i <= 7)			/* basic system colors */
+		return i + 8;
+	if (BETWEEN(i, 16, 195))	/* 256 colors */
+		return i + 36;
+	if (BETWEEN(i, 232, 251))	/* greyscale */
+		return i + 4;
+	/*
+	 * Those ranges will not be brightened:
+	 *      8 - 15 – bright system colors
+	 *      196 - 231 – highest 256 color cube
+	 *      252 - 255 – brightest colors in greyscale
+	 */
+	return i;
+}
+
 static void xloadcolors(struct st_window *xw)
 {
 	int i, r, g, b;
@@ -909,6 +2479,12 @@ static void xloadcolors(struct st_window *xw)
 					&color, &xw->col[i]))
 			die("Could not allocate color %d\n", i);
 	}
+
+	/* so drawing only has to index these: */
+	for (i = 0; i < NCOLORS; i++) {
+		xloadreverse(xw, i);
+		xw->bold[i] = bold_color(i);
+	}
 }
 
 static void xhints(struct st_window *xw)
@@ -1018,28 +2594,25 @@ static void xloadfonts(struct st_window *xw, int zoom)
 	free(fontstr);
 }
 
+static void xunloadfont(struct st_window *xw, struct st_font *f)
+{
+	XftFontClose(xw->dpy, f->match);
+	FcPatternDestroy(f->pattern);
+	FcFontSetDestroy(f->set);
+
+	/* the glyphs cached for it are only good for this size */
+	memset(f->direct, 0, sizeof(f->direct));
+	glyphcache_free(&f->glyphs);
+}
+
 static void xunloadfonts(struct st_window *xw)
 {
-	/*
-	 * Free the loaded fonts in the font cache. This is done backwards
-	 * from the frccur.
-	 */
-	for (unsigned i = 0; i < ARRAY_SIZE(xw->fontcache); i++)
-		if (xw->fontcache[i].font)
-			XftFontClose(xw->dpy, xw->fontcache[i].font);
-
-	XftFontClose(xw->dpy, xw->font.match);
-	FcPatternDestroy(xw->font.pattern);
-	FcFontSetDestroy(xw->font.set);
-	XftFontClose(xw->dpy, xw->bfont.match);
-	FcPatternDestroy(xw->bfont.pattern);
-	FcFontSetDestroy(xw->bfont.set);
-	XftFontClose(xw->dpy, xw->ifont.match);
-	FcPatternDestroy(xw->ifont.pattern);
-	FcFontSetDestroy(xw->ifont.set);
-	XftFontClose(xw->dpy, xw->ibfont.match);
-	FcPatternDestroy(xw->ibfont.pattern);
-	FcFontSetDestroy(xw->ibfont.set);
+	atlas_clear(&xw->shm);
+	fontcache_clear(xw);
+	xunloadfont(xw, &xw->font);
+	xunloadfont(xw, &xw->bfont);
+	xunloadfont(xw, &xw->ifont);
+	xunloadfont(xw, &xw->ibfont);
 }
 
 __attribute((unused))
@@ -1100,6 +2673,7 @@ static void xinit(struct st_window *xw)
 	attrs.bit_gravity = NorthWestGravity;
 	attrs.event_mask = FocusChangeMask | KeyPressMask
 	    | ExposureMask | VisibilityChangeMask | StructureNotifyMask
+	    | PropertyChangeMask
 	    | ButtonMotionMask | ButtonPressMask | ButtonReleaseMask;
 	attrs.colormap = xw->cmap;
 
@@ -1115,15 +2689,18 @@ static void xinit(struct st_window *xw)
 	memset(&gcvalues, 0, sizeof(gcvalues));
 	gcvalues.graphics_exposures = False;
 	xw->gc = XCreateGC(xw->dpy, parent, GCGraphicsExposures, &gcvalues);
-	xw->buf = XCreatePixmap(xw->dpy, xw->win, xw->winsize.x, xw->winsize.y,
-				DefaultDepth(xw->dpy, xw->scr));
-	XSetForeground(xw->dpy, xw->gc, xw->col[defaultbg].pixel);
-	XFillRectangle(xw->dpy, xw->buf, xw->gc, 0, 0,
-		       xw->winsize.x, xw->winsize.y);
 
-	/* Xft rendering context */
-	xw->draw = XftDrawCreate(xw->dpy, xw->buf,
-				    xw->vis, xw->cmap);
+	/* frame buffer: MIT-SHM if asked for and it works, else Xft */
+	if (xw->useshm && shm_supported(xw) && shm_resize(xw)) {
+		xw->backend = &shm_backend;
+		pool_init(xw, xw->renderthreads ?:
+			  min(sysconf(_SC_NPROCESSORS_ONLN), 8L));
+	} else {
+		if (xw->useshm)
+			fprintf(stderr, "st: MIT-SHM unavailable, using Xft\n");
+		xw->backend = &xft_backend;
+		xft_resize(xw);
+	}
 
 	/* input methods */
 	if ((xw->xim = XOpenIM(xw->dpy, NULL, NULL, NULL)) == NULL) {
@@ -1160,6 +2737,12 @@ static void xinit(struct st_window *xw)
 	if (xw->selection == None)
 		xw->selection = XA_STRING;
 
+	xw->xa_targets = XInternAtom(xw->dpy, "TARGETS", 0);
+	xw->xa_incr = XInternAtom(xw->dpy, "INCR", 0);
+	/* what fits in one ChangeProperty request, with room for the rest */
+	xw->incrsize = min(XMaxRequestSize(xw->dpy) * 4 - 64, 256L * 1024);
+	xerrorxlib = XSetErrorHandler(xerror);
+
 	xsettitle(&xw->term, NULL);
 	XMapWindow(xw->dpy, xw->win);
 	xhints(xw);
@@ -1168,7 +2751,13 @@ static void xinit(struct st_window *xw)
 
 static void expose(struct st_window *xw, XEvent *ev)
 {
-	xw->term.dirty = true;
+	XExposeEvent *e = &ev->xexpose;
+
+	/* xw->buf still has everything drawn so far, just put it back: */
+	copy_rect(xw, (XRectangle) {
+		.x = e->x, .y = e->y,
+		.width = e->width, .height = e->height,
+	});
 }
 
 static void visibility(struct st_window *xw, XEvent *ev)
@@ -1212,6 +2801,19 @@ static void numlock(struct st_window *xw, const union st_arg *dummy)
 	xw->term.numlock ^= 1;
 }
 
+/* Scroll the view by arg->i lines, or by a screenful if negative */
+static void kscrollup(struct st_window *xw, const union st_arg *arg)
+{
+	term_scroll_view(&xw->term, arg->i >= 0
+			 ? arg->i : xw->term.size.y);
+}
+
+static void kscrolldown(struct st_window *xw, const union st_arg *arg)
+{
+	term_scroll_view(&xw->term, arg->i >= 0
+			 ? -arg->i : -xw->term.size.y);
+}
+
 static void cmessage(struct st_window *xw, XEvent *ev)
 {
 	/*
@@ -1233,27 +2835,177 @@ static void cmessage(struct st_window *xw, XEvent *ev)
 	}
 }
 
-static struct timeval monotonic_gettime(void)
+/*
+ * term_fill() came up empty: if it's for good, the shell is gone and so are we
+ */
+static void ttyreaddone(ssize_t ret)
 {
-	struct timespec now;
+	if (!ret)
+		exit(EXIT_SUCCESS);
+	if (errno != EAGAIN && errno != EINTR)
+		edie("Couldn't read from shell");
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &now);
+static size_t ttyflush(struct st_window *xw)
+{
+	ssize_t ret = term_flush(&xw->term);
 
-	return (struct timeval) {
-		.tv_sec = now.tv_sec,
-		.tv_usec = now.tv_nsec / 1000,
-	};
+	if (ret < 0)
+		edie("write error on tty");
+	return ret;
+}
+
+/*
+ * With threaded set, the shell is read and parsed here while the main thread
+ * handles X: the lock is only held while parsing what one read returned, and
+ * the main thread gets woken up when there's something new to draw.
+ */
+static void *reader(void *arg)
+{
+	struct st_window *xw = arg;
+	sigset_t set;
+	fd_set rfd;
+	ssize_t ret;
+	bool wake;
+
+	/* SIGUSR1 is for the main thread's pselect() */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	while (1) {
+		FD_ZERO(&rfd);
+		FD_SET(xw->term.cmdfd, &rfd);
+
+		if (select(xw->term.cmdfd + 1, &rfd, NULL, NULL, NULL) < 0 &&
+		    errno != EINTR)
+			edie("select failed");
+
+		while ((ret = term_fill(&xw->term)) > 0) {
+			pthread_mutex_lock(&xw->lock);
+			wake = !xw->term.dirty;
+			term_parse(&xw->term);
+			wake &= xw->term.dirty;
+			xw->lastread = monotonic_gettime();
+			/* this may be the echo, don't let it wait for a frame */
+			if (xw->echo_pending)
+				wake = true;
+			/* replies the pty won't take now, the main thread waits */
+			if (ttyflush(xw))
+				wake = true;
+			pthread_mutex_unlock(&xw->lock);
+
+			if (wake && write(xw->wakefd[1], "", 1) < 0 &&
+			    errno != EAGAIN)
+				edie("Couldn't wake up main thread");
+		}
+
+		ttyreaddone(ret);
+	}
+
+	return NULL;
+}
+
+/*
+ * Frame scheduling: the first output of the shell after a key press may be
+ * its echo, and is drawn right away - damage from before that doesn't count,
+ * it's only whatever the shell was already busy with. Otherwise frames are
+ * xw->delay apart - 1/fps, growing while the shell keeps damaging the screen
+ * faster than that, back to 1/fps once it stops. Nothing to draw, no timeout.
+ *
+ * Returns whether to draw now, otherwise sets *timeout for select().
+ */
+static bool schedule(struct st_window *xw, struct timeval now,
+		     struct timeval **timeout)
+{
+	unsigned base = 1000 * 1000 / xw->fps;
+
+	*timeout = NULL;
+
+	if (!xw->visible || !xw->term.dirty)
+		return false;
+
+	if (xw->echo_pending && TIMEDIFF(now, xw->lastkey) >= ECHO_TIMEOUT)
+		xw->echo_pending = false;
+
+	if (xw->echo_pending && timercmp(&xw->lastread, &xw->lastkey, >)) {
+		xw->echo_frame = true;
+		xw->delay = base;
+		return true;
+	}
+
+	if (timercmp(&now, &xw->next_redraw, <)) {
+		xw->waited = true;
+		timersub(&xw->next_redraw, &now, &xw->timeout);
+		*timeout = &xw->timeout;
+		return false;
+	}
+
+	xw->delay = xw->waited
+		? min(xw->delay + base / 4, 4 * base)
+		: base;
+	xw->waited = false;
+	return true;
+}
+
+static void drawn(struct st_window *xw, struct timeval now)
+{
+	struct timeval delay = {
+		.tv_sec = xw->delay / (1000 * 1000),
+		.tv_usec = xw->delay % (1000 * 1000),
+	}, t;
+
+	timeradd(&now, &delay, &xw->next_redraw);
+
+	if (!xw->echo_frame)
+		return;
+
+	if (xw->loglatency) {
+		now = monotonic_gettime();
+		timersub(&now, &xw->lastkey, &t);
+		fprintf(stderr, "key to echo: %ld.%03ld ms\n",
+			t.tv_sec * 1000 + t.tv_usec / 1000, t.tv_usec % 1000);
+	}
+
+	xw->echo_frame = false;
+	xw->echo_pending = false;
+}
+
+/* SIGUSR1: where the time went, to stderr */
+static volatile sig_atomic_t dumpstats;
+
+static void sigusr1(int sig)
+{
+	dumpstats = 1;
+}
+
+static void statsdump(struct st_window *xw)
+{
+	fprintf(stderr, "frames: %lu, %lu cells, %lu.%03lu ms drawing, "
+		"%lu.%03lu ms flushing\n"
+		"fontcache: %lu hits, %lu misses\n"
+		"rgbcache: %lu hits, %lu misses\n",
+		xw->frames, xw->cells,
+		xw->draw_us / 1000, xw->draw_us % 1000,
+		xw->flush_us / 1000, xw->flush_us % 1000,
+		xw->fontcache.hits, xw->fontcache.misses,
+		xw->rgbcache.hits, xw->rgbcache.misses);
+	term_stats(&xw->term, stderr);
 }
 
 static void run(struct st_window *xw)
 {
 	XEvent ev;
-	fd_set rfd;
+	fd_set rfd, wfd;
 	int xfd = XConnectionNumber(xw->dpy);
-	struct timeval now, next_redraw, t, *timeout = NULL, delay = {
-		.tv_sec = 0,
-		.tv_usec = 1000 * 1000 / xw->fps,
-	};
+	int ttyfd = xw->threaded ? xw->wakefd[0] : xw->term.cmdfd;
+	char buf[64];
+	bool redraw, pending = false;
+	sigset_t usr1, waitmask;
+	struct timespec ts;
+	pthread_t thread;
+	ssize_t ret;
+	struct timeval now, *timeout = NULL;
 
 	void (*handler[]) (struct st_window *, XEvent *) = {
 		[KeyPress] = kpress,
@@ -1269,21 +3021,67 @@ static void run(struct st_window *xw)
 		[ButtonRelease] = brelease,
 		[SelectionClear] = selclear,
 		[SelectionNotify] = selnotify,
-		[SelectionRequest] = selrequest,};
+		[SelectionRequest] = selrequest,
+		[PropertyNotify] = propnotify,};
 
-	next_redraw = monotonic_gettime();
+	/*
+	 * SIGUSR1 only gets through while we wait, so it can't come in just
+	 * after we've checked for it and leave us asleep
+	 */
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, &waitmask);
+	sigdelset(&waitmask, SIGUSR1);
+	signal(SIGUSR1, sigusr1);
+
+	if (xw->threaded &&
+	    pthread_create(&thread, NULL, reader, xw))
+		die("Couldn't create reader thread\n");
+
+	xw->next_redraw = monotonic_gettime();
 
 	while (1) {
 		FD_ZERO(&rfd);
-		FD_SET(xw->term.cmdfd, &rfd);
+		FD_SET(ttyfd, &rfd);
 		FD_SET(xfd, &rfd);
 
-		if ((select(max(xfd, xw->term.cmdfd) + 1,
-			    &rfd, NULL, NULL, timeout) < 0) &&
+		/* reading goes on while the shell catches up with our writes */
+		FD_ZERO(&wfd);
+		if (pending)
+			FD_SET(xw->term.cmdfd, &wfd);
+
+		if (timeout)
+			ts = (struct timespec) {
+				.tv_sec		= timeout->tv_sec,
+				.tv_nsec	= timeout->tv_usec * 1000,
+			};
+
+		if ((pselect(max(max(xfd, ttyfd), xw->term.cmdfd) + 1,
+			     &rfd, &wfd, NULL, timeout ? &ts : NULL,
+			     &waitmask) < 0) &&
 		    errno != EINTR)
 			edie("select failed");
 
-		term_read(&xw->term);
+		if (xw->threaded)
+			while (read(ttyfd, buf, sizeof(buf)) > 0)
+				;
+
+		pthread_mutex_lock(&xw->lock);
+
+		if (dumpstats) {
+			dumpstats = 0;
+			statsdump(xw);
+		}
+
+		if (!xw->threaded) {
+			unsigned long reads = xw->term.stats.reads;
+
+			ret = term_read(&xw->term, xw->readslice * 1000);
+			if (xw->term.stats.reads != reads)
+				xw->lastread = monotonic_gettime();
+			if (ret <= 0)
+				ttyreaddone(ret);
+		}
 
 		while (XPending(xw->dpy)) {
 			XNextEvent(xw->dpy, &ev);
@@ -1294,24 +3092,163 @@ static void run(struct st_window *xw)
 				(handler[ev.type])(xw, &ev);
 		}
 
+		/*
+		 * keys, replies and pastes, all in one write - and if the pty
+		 * took all of it, there may be more paste for it
+		 */
+		paste(xw);
+		pending = ttyflush(xw) ||
+			(xw->paste != None && !xw->pastewait);
+
 		now = monotonic_gettime();
 
-		if (xw->visible &&
-		    xw->term.dirty &&
-		    timercmp(&now, &next_redraw, >=)) {
-			draw(xw);
-			timeradd(&now, &delay, &next_redraw);
+		redraw = schedule(xw, now, &timeout);
+		if (redraw)
+			term_snapshot(&xw->term, &xw->snap);
+
+		/* so a transfer that stalled doesn't keep its text forever */
+		if (xw->incr) {
+			incr_reap(xw, None, None);
+			if (xw->incr && !timeout) {
+				xw->timeout = (struct timeval) {
+					.tv_sec = INCR_TIMEOUT / 1000,
+				};
+				timeout = &xw->timeout;
+			}
 		}
 
-		if (xw->visible && xw->term.dirty) {
-			timersub(&next_redraw, &now, &t);
-			timeout = &t;
-		} else {
-			timeout = NULL;
+		/* the reader can go on while we draw from the snapshot */
+		pthread_mutex_unlock(&xw->lock);
+
+		if (redraw) {
+			draw(xw);
+			drawn(xw, now);
 		}
 	}
 }
 
+/* Render benchmark */
+
+static int cmp_ulong(const void *l, const void *r)
+{
+	unsigned long a = *(const unsigned long *) l;
+	unsigned long b = *(const unsigned long *) r;
+
+	return a < b ? -1 : a > b;
+}
+
+/* What we've written, which here is all to the X server - Linux only */
+static unsigned long long written(void)
+{
+	unsigned long long wchar = 0;
+	char line[64];
+	FILE *f = fopen("/proc/self/io", "r");
+
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "wchar: %llu", &wchar) == 1)
+			break;
+
+	fclose(f);
+	return wchar;
+}
+
+static void bench_frames(struct st_window *xw, const char *name, bool full)
+{
+	unsigned i, n = xw->benchframes;
+	unsigned long *us = xmalloc(n * sizeof(*us)), requests;
+	unsigned long long bytes;
+	struct timeval start, end;
+
+	requests = NextRequest(xw->dpy);
+	bytes = written();
+
+	for (i = 0; i < n; i++) {
+		if (full)
+			term_damage_all(&xw->term);
+		else
+			/* a line at a time, like someone typing */
+			term_damage_view(&xw->term, i % xw->term.size.y,
+					 0, xw->term.size.x);
+
+		term_snapshot(&xw->term, &xw->snap);
+
+		/* until the server is done with it */
+		start = monotonic_gettime();
+		draw(xw);
+		XSync(xw->dpy, False);
+		end = monotonic_gettime();
+
+		timersub(&end, &start, &end);
+		us[i] = end.tv_sec * 1000000 + end.tv_usec;
+	}
+
+	requests = NextRequest(xw->dpy) - requests;
+	bytes = written() - bytes;
+
+	qsort(us, n, sizeof(us[0]), cmp_ulong);
+
+	printf("%s: %u frames, us p50 %lu p90 %lu p99 %lu max %lu, "
+	       "%lu requests %llu bytes per frame\n",
+	       name, n, us[n / 2], us[n * 9 / 10], us[n * 99 / 100], us[n - 1],
+	       requests / n, bytes / n);
+	free(us);
+}
+
+/*
+ * st -B file: puts what's in @file on the screen - anything st -o recorded -
+ * then redraws it, all of it and a line at a time, and reports frame times
+ * and what the frames cost in requests and bytes sent to the server. With the
+ * shm backend, full redraws are timed again with 1, 2, 4... of the render
+ * threads, for how compositing scales.
+ */
+static void bench(struct st_window *xw)
+{
+	int fd = strcmp(xw->bench, "-") ? open(xw->bench, O_RDONLY) : 0;
+	struct st_pool *pool = &xw->shm.pool;
+	char buf[BUFSIZ];
+	unsigned threads;
+	ssize_t n;
+	XEvent ev;
+
+	if (fd < 0)
+		edie("Couldn't open %s", xw->bench);
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		term_feed(&xw->term, buf, n);
+	if (n < 0)
+		edie("Couldn't read %s", xw->bench);
+	close(fd);
+
+	/* whatever size the window manager gave us */
+	XSync(xw->dpy, False);
+	while (XPending(xw->dpy)) {
+		XNextEvent(xw->dpy, &ev);
+		if (ev.type == ConfigureNotify)
+			resize(xw, &ev);
+	}
+
+	printf("%ux%u, %s backend\n", xw->term.size.x, xw->term.size.y,
+	       xw->backend->name);
+
+	bench_frames(xw, "full", true);
+	bench_frames(xw, "line", false);
+
+	if (xw->backend != &shm_backend)
+		return;
+
+	for (threads = 1;; threads = min(threads * 2, pool->nworkers)) {
+		pool->active = threads;
+		snprintf(buf, sizeof(buf), "full, %u threads", threads);
+		bench_frames(xw, buf, true);
+
+		if (threads == pool->nworkers)
+			break;
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	int opt, bitm, xr, yr;
@@ -1330,11 +3267,26 @@ int main(int argc, char *argv[])
 	xw.settings		= g_settings_new("org.evilpiepirate.st");
 	xw.borderpx		= g_settings_get_uint(xw.settings, "borderpx");
 	xw.fps			= g_settings_get_uint(xw.settings, "fps");
+	xw.scrollback		= g_settings_get_uint(xw.settings, "scrollback");
+	xw.threaded		= g_settings_get_boolean(xw.settings, "threaded");
+	xw.readslice		= g_settings_get_uint(xw.settings, "readslice");
+	xw.loglatency		= g_settings_get_boolean(xw.settings, "loglatency");
+	xw.logframes		= g_settings_get_boolean(xw.settings, "logframes");
+	xw.useshm		= g_settings_get_boolean(xw.settings, "shm");
+	xw.renderthreads	= g_settings_get_uint(xw.settings, "renderthreads");
 	xw.doubleclicktimeout	= g_settings_get_uint(xw.settings, "doubleclicktimeout");
 	xw.tripleclicktimeout	= g_settings_get_uint(xw.settings, "tripleclicktimeout");
 
-	while ((opt = getopt(argc, argv, "+c:g:o:t:w:e:v") != -1))
+	xw.benchframes		= 500;
+
+	while ((opt = getopt(argc, argv, "+B:c:g:n:o:t:w:e:v")) != -1)
 		switch (opt) {
+		case 'B':
+			xw.bench = optarg;
+			break;
+		case 'n':
+			xw.benchframes = max(atoi(optarg), 1);
+			break;
 		case 'c':
 			xw.class = optarg;
 			break;
@@ -1374,11 +3326,29 @@ int main(int argc, char *argv[])
 			die(USAGE);
 		}
 run:
+	pthread_mutex_init(&xw.lock, NULL);
+	if (xw.threaded) {
+		if (!XInitThreads())
+			die("Couldn't initialize Xlib threads\n");
+
+		if (pipe(xw.wakefd) ||
+		    fcntl(xw.wakefd[0], F_SETFL, O_NONBLOCK) ||
+		    fcntl(xw.wakefd[1], F_SETFL, O_NONBLOCK))
+			edie("Couldn't create pipe");
+	}
+
 	setlocale(LC_CTYPE, "");
 	XSetLocaleModifiers("");
-	term_init(&xw.term, 80, 24, shell, opt_cmd, opt_io, xw.win,
-		  defaultfg, defaultbg, defaultcs);
+	term_init(&xw.term, 80, 24,
+		  defaultfg, defaultbg, defaultcs, xw.scrollback);
 	xinit(&xw);
+
+	if (xw.bench) {
+		bench(&xw);
+		return 0;
+	}
+
+	term_spawn(&xw.term, shell, opt_cmd, opt_io, xw.win);
 	run(&xw);
 
 	return 0;
@@ -5,11 +5,16 @@
 #include <limits.h>
 #include <pwd.h>
 #include <signal.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
-#include <X11/X.h> // XXX
+#include <time.h>
 
 #include <fontconfig/fontconfig.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #if   defined(__linux)
 #include <pty.h>
 #elif defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__)
@@ -22,17 +27,97 @@
 
 #include "term.h"
 
+/* Damage tracking */
+
+static void damage_lines(struct st_term *term, unsigned y1, unsigned y2)
+{
+	for (unsigned y = y1; y <= min(y2, term->size.y - 1); y++)
+		term_damage_view(term, y, 0, term->size.x);
+}
+
+void term_damage_all(struct st_term *term)
+{
+	damage_lines(term, 0, term->size.y - 1);
+
+	/* everything gets repainted, moving pixels around first is pointless */
+	term->nscrolls = 0;
+}
+
+/*
+ * Lines that only moved don't need to be repainted - the renderer replays the
+ * log by moving what it already drew. Damage moves along with the lines, so
+ * it's always relative to the current view:
+ */
+static void scrolllog(struct st_term *term, unsigned top, unsigned bot, int n)
+{
+	struct scroll *s = term->scrolls + term->nscrolls;
+
+	if (!n)
+		return;
+
+	if (term->nscrolls && s[-1].top == top && s[-1].bot == bot) {
+		s[-1].n += n;
+	} else if (term->nscrolls < ARRAY_SIZE(term->scrolls)) {
+		term->scrolls[term->nscrolls++] = (struct scroll) { top, bot, n };
+	} else {
+		/* too much going on, just repaint everything */
+		term_damage_all(term);
+	}
+}
+
+/* Lines [top, bot] of the view moved up by n (down, if negative) */
+static void viewscroll(struct st_term *term, int top, int bot, int n)
+{
+	int i;
+
+	n = clamp_t(int, n, top - bot - 1, bot - top + 1);
+
+	if (n > 0) {
+		for (i = top; i <= bot - n; i++)
+			swap(term->damage[i], term->damage[i + n]);
+		damage_lines(term, bot - n + 1, bot);
+	} else if (n < 0) {
+		for (i = bot; i >= top - n; i--)
+			swap(term->damage[i], term->damage[i + n]);
+		damage_lines(term, top, top - n - 1);
+	}
+
+	scrolllog(term, top, bot, n);
+}
+
 /* Selection code */
 
+static void seldamage(struct st_term *term)
+{
+	struct st_selection *sel = &term->sel;
+
+	if (sel->type != SEL_NONE)
+		damage_lines(term, sel->p1.y, sel->p2.y);
+}
+
 static void selscroll(struct st_term *term, int orig, int n)
 {
 	struct st_selection *sel = &term->sel;
+	bool reshape;
 
 	if (sel->type == SEL_NONE)
 		return;
 
 	if (BETWEEN(sel->p1.y, orig, term->bot) ||
 	    BETWEEN(sel->p2.y, orig, term->bot)) {
+		/*
+		 * The highlight was moved along with the lines; if the
+		 * selection doesn't fit in the region it's about to change
+		 * shape, so repaint both what it was and what it'll be:
+		 */
+		reshape = sel->p1.y < orig || sel->p2.y > term->bot ||
+			(int) sel->p1.y + n < orig ||
+			(int) sel->p2.y + n > (int) term->bot;
+		if (reshape) {
+			seldamage(term);
+			damage_lines(term, orig, term->bot);
+		}
+
 		if ((sel->p1.y += n) > term->bot ||
 		    (sel->p2.y += n) < term->top) {
 			sel->type = SEL_NONE;
@@ -49,7 +134,7 @@ static void selscroll(struct st_term *term, int orig, int n)
 			}
 			if (sel->p2.y > term->bot) {
 				sel->p2.y = term->bot;
-				sel->p2.x = term->size.y;
+				sel->p2.x = term->size.x - 1;
 			}
 			break;
 		case SEL_RECTANGULAR:
@@ -59,6 +144,9 @@ static void selscroll(struct st_term *term, int orig, int n)
 				sel->p2.y = term->bot;
 			break;
 		};
+
+		if (reshape)
+			seldamage(term);
 	}
 }
 
@@ -86,38 +174,63 @@ bool term_selected(struct st_selection *sel, int x, int y)
 	return false;
 }
 
+/*
+ * Encodes the selection as UTF-8 into sel->clip, a line at a time - the buffer
+ * only grows as far as the text needs. If the old text is still being sent
+ * somewhere, it's left alone and this gets a new one.
+ */
 static void term_sel_copy(struct st_term *term)
 {
 	struct st_selection *sel = &term->sel;
-	unsigned char *str = NULL, *ptr;
+	struct st_clip *clip = sel->clip;
+	unsigned y, y2 = min(sel->p2.y, term->size.y - 1);
+	size_t need;
 
-	if (sel->type == SEL_NONE)
-		goto out;
+	if (clip && clip->refs > 1) {
+		clip_put(clip);
+		clip = NULL;
+	}
+
+	if (!clip) {
+		clip = xmalloc(sizeof(*clip) + 64);
+		clip->refs = 1;
+		clip->size = 64;
+	}
 
-	ptr = str = xmalloc((sel->p2.y - sel->p1.y + 1) *
-			    term->size.x * UTF_SIZ);
+	clip->len = 0;
+	sel->dirty = false;
 
-	/* append every set & selected glyph to the selection */
-	for (unsigned y = sel->p1.y; y <= sel->p2.y; y++) {
-		struct st_glyph *gp = &term->line[y][0];
-		struct st_glyph *last = &term->line[y][term->size.x - 1];
+	for (y = sel->p1.y; y <= y2; y++) {
+		struct st_glyph *line = term_line(term, y);
+		struct st_glyph *gp = &line[0];
+		struct st_glyph *last = &line[term->size.x - 1];
+		char *ptr;
 
 		if (sel->type == SEL_RECTANGULAR ||
 		    y == sel->p1.y)
-			gp = &term->line[y][sel->p1.x];
+			gp = &line[min(sel->p1.x, term->size.x - 1)];
 
 		if (sel->type == SEL_RECTANGULAR ||
 		    y == sel->p2.y)
-			last = &term->line[y][sel->p2.x];
+			last = &line[min(sel->p2.x, term->size.x - 1)];
 
 		while (last > gp && !last->c)
 			last--;
 
+		/* room for the line, a newline and the nul */
+		need = clip->len + (last >= gp ? last - gp + 1 : 0) * UTF_SIZ + 2;
+		if (need > clip->size) {
+			clip->size = max(clip->size * 2, need);
+			clip = xrealloc(clip, sizeof(*clip) + clip->size);
+		}
+
+		ptr = clip->data + clip->len;
+
 		for (; gp <= last; gp++) {
 			int len;
 
 			if (gp->c &&
-			    (len = FcUcs4ToUtf8(gp->c, ptr) > 0))
+			    (len = FcUcs4ToUtf8(gp->c, (FcChar8 *) ptr)) > 0)
 				ptr += len;
 			else
 				*ptr++ = ' ';
@@ -127,13 +240,29 @@ static void term_sel_copy(struct st_term *term)
 		 * XXX: this logic is wrong, we need to remember when there's a
 		 * newline at the end of the line
 		 */
-		if (y < sel->p2.y && last < &term->line[y][term->size.x - 1])
+		if (y < y2 && last < &line[term->size.x - 1])
 			*ptr++ = '\r';
+
+		clip->len = ptr - clip->data;
 	}
-	*ptr = 0;
-out:
-	free(sel->clip);
-	sel->clip = (char *) str;
+
+	clip->data[clip->len] = 0;
+	sel->clip = clip;
+}
+
+/*
+ * The selected text, or what was selected last if the selection has since
+ * been cleared: only encoded when asked for, and again after the cells under
+ * the selection change.
+ */
+struct st_clip *term_sel_text(struct st_term *term)
+{
+	struct st_selection *sel = &term->sel;
+
+	if (sel->type != SEL_NONE && (sel->dirty || !sel->clip))
+		term_sel_copy(term);
+
+	return sel->clip;
 }
 
 void term_sel_update(struct st_term *term, unsigned type,
@@ -141,6 +270,8 @@ void term_sel_update(struct st_term *term, unsigned type,
 {
 	struct st_selection *sel = &term->sel;
 
+	seldamage(term);
+
 	sel->p1 = start;
 	sel->p2 = end;
 
@@ -156,20 +287,18 @@ void term_sel_update(struct st_term *term, unsigned type,
 		    (sel->p1.y == sel->p2.y &&
 		     sel->p1.x > sel->p2.x))
 			swap(sel->p1, sel->p2);
-
-		term_sel_copy(term);
 		break;
 	case SEL_RECTANGULAR:
 		if (sel->p1.x > sel->p2.x)
 			swap(sel->p1.x, sel->p2.x);
 		if (sel->p1.y > sel->p2.y)
 			swap(sel->p1.y, sel->p2.y);
-
-		term_sel_copy(term);
 		break;
 	}
 
-	term->dirty = true;
+	/* just the ends while dragging, the text is made when it's wanted */
+	seldamage(term);
+	sel->dirty = true;
 }
 
 static bool isword(unsigned c)
@@ -194,7 +323,7 @@ void term_sel_word(struct st_term *term, struct coord pos)
 		} else
 			break;
 
-		if (!isword(term_pos(term, prev)->c))
+		if (!isword(term_line(term, prev.y)[prev.x].c))
 			break;
 
 		start = prev;
@@ -211,7 +340,7 @@ void term_sel_word(struct st_term *term, struct coord pos)
 		} else
 			break;
 
-		if (!isword(term_pos(term, next)->c))
+		if (!isword(term_line(term, next.y)[next.x].c))
 			break;
 
 		pos = next;
@@ -232,60 +361,228 @@ void term_sel_line(struct st_term *term, struct coord pos)
 
 void term_sel_stop(struct st_term *term)
 {
+	/* we may still own the selection, keep the text it had */
+	term_sel_text(term);
+
+	seldamage(term);
 	term->sel.type = SEL_NONE;
-	term->dirty = true;
 }
 
-/* Escape handling */
+/* Snapshots */
+
+static void snapshot_resize(struct st_snapshot *snap, struct coord size)
+{
+	unsigned y;
+
+	free(snap->line);
+	free(snap->glyphs);
+	free(snap->damage);
+
+	snap->size	= size;
+	snap->line	= xcalloc(size.y, sizeof(*snap->line));
+	snap->glyphs	= xcalloc(size.x * size.y, sizeof(struct st_glyph));
+	snap->damage	= xcalloc(size.y, sizeof(struct damage));
 
-static void csiparse(struct csi_escape *csi)
+	for (y = 0; y < size.y; y++)
+		snap->line[y] = snap->glyphs + y * size.x;
+}
+
+void term_snapshot(struct st_term *term, struct st_snapshot *snap)
 {
-	char *p = csi->buf, *np;
-	long int v;
+	struct scroll *s;
+	unsigned x, y;
 
-	csi->narg = 0;
-	if (*p == '?') {
-		csi->priv = 1;
-		p++;
+	if (snap->size.x != term->size.x ||
+	    snap->size.y != term->size.y) {
+		snapshot_resize(snap, term->size);
+		term_damage_all(term);
 	}
 
-	csi->buf[csi->len] = '\0';
-	while (p < csi->buf + csi->len) {
-		np = NULL;
-		v = strtol(p, &np, 10);
-		if (np == p)
-			v = 0;
-		if (v == LONG_MAX || v == LONG_MIN)
-			v = -1;
-		csi->arg[csi->narg++] = v;
-		p = np;
-		if (*p != ';' || csi->narg == ESC_ARG_SIZ)
+	/* move our lines the same way, then only damaged cells need copying */
+	for (s = term->scrolls; s < term->scrolls + term->nscrolls; s++) {
+		unsigned height = s->bot - s->top + 1, n = abs(s->n);
+		struct st_glyph **line = snap->line + s->top;
+
+		if (!n || n >= height)
+			continue;
+
+		if (s->n > 0) {
+			struct st_glyph *tmp[n];
+
+			memcpy(tmp, line, sizeof(tmp));
+			memmove(line, line + n, (height - n) * sizeof(*line));
+			memcpy(line + height - n, tmp, sizeof(tmp));
+		} else {
+			struct st_glyph *tmp[n];
+
+			memcpy(tmp, line + height - n, sizeof(tmp));
+			memmove(line + n, line, (height - n) * sizeof(*line));
+			memcpy(line, tmp, sizeof(tmp));
+		}
+	}
+
+	memcpy(snap->scrolls, term->scrolls, sizeof(snap->scrolls));
+	snap->nscrolls = term->nscrolls;
+	term->nscrolls = 0;
+
+	for (y = 0; y < term->size.y; y++) {
+		struct damage d = term->damage[y];
+		struct st_glyph *src = term_line(term, y);
+
+		snap->damage[y] = d;
+		if (d.x1 >= d.x2)
+			continue;
+
+		term->damage[y] = NODAMAGE;
+
+		for (x = d.x1; x < min(d.x2, term->size.x); x++) {
+			snap->line[y][x] = src[x];
+			snap->line[y][x].reverse ^=
+				term_selected(&term->sel, x, y);
+		}
+	}
+
+	/* only cells still on screen use them, and they're all copied */
+	if (term->truecolor_changed) {
+		memcpy(snap->truecolor, term->truecolor, sizeof(snap->truecolor));
+		term->truecolor_changed = false;
+	}
+
+	snap->cursor	= term->c.pos;
+	snap->cursor.y	+= term->scroll;
+	snap->hide	= term->hide;
+	snap->reverse	= term->reverse;
+
+	term->dirty = false;
+}
+
+/* Escape handling */
+
+/*
+ * CSI sequences are parsed a byte at a time as they come in, following the DEC
+ * ANSI parser model: a transition table maps the current state and byte to an
+ * action and the next state. Control codes are handled by tputc() before we
+ * get here.
+ */
+enum csi_state {
+	CSI_ENTRY,
+	CSI_PARAM,
+	CSI_INTER,
+	CSI_IGNORE,
+	CSI_NSTATES,
+};
+
+enum csi_action {
+	CSI_NONE,
+	CSI_DIGIT,
+	CSI_SEP,
+	CSI_SUBSEP,
+	CSI_PRIV,
+	CSI_COLLECT,
+	CSI_DISPATCH,
+	CSI_END,
+};
+
+#define CSI_T(action, state)	((action) << 2 | (state))
+
+static const unsigned char csi_table[CSI_NSTATES][0x80] = {
+	[CSI_ENTRY] = {
+		[0x20 ... 0x2f]	= CSI_T(CSI_COLLECT,	CSI_INTER),
+		[0x30 ... 0x39]	= CSI_T(CSI_DIGIT,	CSI_PARAM),
+		[':']		= CSI_T(CSI_SUBSEP,	CSI_PARAM),
+		[';']		= CSI_T(CSI_SEP,	CSI_PARAM),
+		[0x3c ... 0x3f]	= CSI_T(CSI_PRIV,	CSI_PARAM),
+		[0x40 ... 0x7e]	= CSI_T(CSI_DISPATCH,	CSI_ENTRY),
+	},
+	[CSI_PARAM] = {
+		[0x20 ... 0x2f]	= CSI_T(CSI_COLLECT,	CSI_INTER),
+		[0x30 ... 0x39]	= CSI_T(CSI_DIGIT,	CSI_PARAM),
+		[':']		= CSI_T(CSI_SUBSEP,	CSI_PARAM),
+		[';']		= CSI_T(CSI_SEP,	CSI_PARAM),
+		[0x3c ... 0x3f]	= CSI_T(CSI_NONE,	CSI_IGNORE),
+		[0x40 ... 0x7e]	= CSI_T(CSI_DISPATCH,	CSI_ENTRY),
+	},
+	[CSI_INTER] = {
+		[0x20 ... 0x2f]	= CSI_T(CSI_COLLECT,	CSI_INTER),
+		[0x30 ... 0x3f]	= CSI_T(CSI_NONE,	CSI_IGNORE),
+		[0x40 ... 0x7e]	= CSI_T(CSI_DISPATCH,	CSI_ENTRY),
+	},
+	[CSI_IGNORE] = {
+		[0x20 ... 0x3f]	= CSI_T(CSI_NONE,	CSI_IGNORE),
+		[0x40 ... 0x7e]	= CSI_T(CSI_END,	CSI_ENTRY),
+	},
+};
+
+/*
+ * Feeds one byte of a CSI sequence to the parser; returns true when the
+ * sequence is finished - it should then be dispatched if csi->mode is set.
+ */
+static bool csiparse(struct csi_escape *csi, unsigned c)
+{
+	unsigned t = c < 0x80
+		? csi_table[csi->state][c]
+		: CSI_T(CSI_NONE, CSI_IGNORE);
+	int *arg;
+
+	csi->state = t & 3;
+
+	switch (t >> 2) {
+	case CSI_DIGIT:
+		if (!csi->narg)
+			csi->narg = 1;
+
+		arg = &csi->arg[csi->narg - 1];
+		*arg = min(*arg * 10 + (int) (c - '0'), ESC_ARG_MAX);
+		break;
+	case CSI_SEP:
+	case CSI_SUBSEP:
+		if (!csi->narg)
+			csi->narg = 1;
+
+		if (csi->narg == ESC_ARG_SIZ) {
+			csi->state = CSI_IGNORE;
 			break;
-		p++;
+		}
+
+		csi->sub[csi->narg++] = c == ':';
+		break;
+	case CSI_PRIV:
+		csi->priv = c;
+		break;
+	case CSI_COLLECT:
+		/* we don't implement anything with more than one */
+		if (csi->inter)
+			csi->state = CSI_IGNORE;
+		csi->inter = c;
+		break;
+	case CSI_DISPATCH:
+		if (!csi->narg)
+			csi->narg = 1;
+		csi->mode = c;
+		return true;
+	case CSI_END:
+		csi->mode = 0;
+		return true;
 	}
-	csi->mode = *p;
+
+	return false;
 }
 
 static void csidump(struct csi_escape *csi)
 {
 	int i;
-	unsigned c;
 
 	printf("ESC[");
-	for (i = 0; i < csi->len; i++) {
-		c = csi->buf[i] & 0xff;
-		if (isprint(c)) {
-			putchar(c);
-		} else if (c == '\n') {
-			printf("(\\n)");
-		} else if (c == '\r') {
-			printf("(\\r)");
-		} else if (c == 0x1b) {
-			printf("(\\e)");
-		} else {
-			printf("(%02x)", c);
-		}
-	}
+	if (csi->priv)
+		putchar(csi->priv);
+
+	for (i = 0; i < csi->narg; i++)
+		printf("%s%d", !i ? "" : csi->sub[i] ? ":" : ";", csi->arg[i]);
+
+	if (csi->inter)
+		putchar(csi->inter);
+	if (isprint(csi->mode))
+		putchar(csi->mode);
 	putchar('\n');
 }
 
@@ -294,6 +591,85 @@ static void csireset(struct csi_escape *csi)
 	memset(csi, 0, sizeof(*csi));
 }
 
+/* Screen storage */
+
+static void screen_init(struct st_screen *s, struct coord size,
+			unsigned histsize)
+{
+	unsigned i, nlines = histsize + size.y;
+
+	s->histsize	= histsize;
+	s->histlen	= 0;
+	/* room to advance, see screen_advance() */
+	s->nindex	= 2 * nlines;
+	s->index	= xcalloc(s->nindex, sizeof(*s->index));
+	s->glyphs	= xcalloc(nlines * size.x, sizeof(struct st_glyph));
+
+	for (i = 0; i < nlines; i++)
+		s->index[i] = s->glyphs + i * size.x;
+
+	s->line = s->index + histsize;
+}
+
+static void screen_free(struct st_screen *s)
+{
+	free(s->index);
+	free(s->glyphs);
+}
+
+/*
+ * Scroll all @rows lines of the screen up by n: the top lines become the
+ * newest lines of scrollback and the oldest lines of scrollback are reused at
+ * the bottom - without scrollback, the top lines themselves are.
+ */
+static void screen_advance(struct st_screen *s, unsigned rows, unsigned n)
+{
+	if (s->line + rows + n > s->index + s->nindex) {
+		/* out of room, move everything back to the start */
+		memmove(s->index, s->line - s->histsize,
+			(s->histsize + rows) * sizeof(*s->index));
+		s->line = s->index + s->histsize;
+	}
+
+	memcpy(s->line + rows, s->line - s->histsize, n * sizeof(*s->line));
+	s->line += n;
+	s->histlen = min(s->histlen + n, s->histsize);
+}
+
+/*
+ * Reallocate for a new size, dropping the first @slide lines of the screen
+ * into scrollback; anything new is filled with @blank:
+ */
+static void screen_resize(struct st_screen *s, struct coord old,
+			  struct coord size, int slide,
+			  struct st_glyph blank)
+{
+	struct st_screen new;
+	unsigned x, cols = min(old.x, size.x);
+	unsigned histlen = min(s->histlen + slide, s->histsize);
+	int y;
+
+	screen_init(&new, size, s->histsize);
+	new.histlen = histlen;
+
+	for (y = -(int) histlen; y < (int) size.y; y++) {
+		struct st_glyph *dst = new.line[y];
+
+		x = 0;
+		if (y + slide < (int) old.y) {
+			memcpy(dst, s->line[y + slide],
+			       cols * sizeof(struct st_glyph));
+			x = cols;
+		}
+
+		for (; x < size.x; x++)
+			dst[x] = blank;
+	}
+
+	screen_free(s);
+	*s = new;
+}
+
 /* t code */
 
 static void __tclearline(struct st_term *term, unsigned y,
@@ -301,10 +677,12 @@ static void __tclearline(struct st_term *term, unsigned y,
 {
 	struct st_glyph *g;
 
-	term->dirty = true;
+	end = min(end, term->size.x);
+
+	term_damage(term, y, start, end);
 
-	for (g = &term->line[y][start];
-	     g < &term->line[y][end];
+	for (g = &term->screen.line[y][start];
+	     g < &term->screen.line[y][end];
 	     g++)
 		*g = term->c.attr;
 }
@@ -323,37 +701,126 @@ static void tclearregion(struct st_term *term, struct coord p1,
 		__tclearline(term, p.y, p1.x, p2.x);
 }
 
-static void tscrolldown(struct st_term *term, int orig, int n)
+/* Scrollback */
+
+/*
+ * Lines [orig, bot] of the screen moved up by n (down, if negative) while the
+ * view is scrolled back: if they went to scrollback, the view stays where it
+ * is so nothing changes; otherwise just repaint what's visible of them.
+ */
+static void tscrolledback(struct st_term *term, int orig, int n, bool pushed)
 {
-	int i;
+	struct st_selection *sel = &term->sel;
 
-	n = clamp_t(int, n, 0, term->bot - orig + 1);
+	if (pushed) {
+		if (term->scroll + n <= term->screen.histlen) {
+			term->scroll += n;
+		} else {
+			/* what we were looking at is gone */
+			term->scroll = term->screen.histlen;
+			term_sel_stop(term);
+			term_damage_all(term);
+		}
+		return;
+	}
 
-	tclearregion(term,
-		     (struct coord) {0, term->bot - n + 1},
-		     (struct coord) {term->size.x, term->bot + 1});
+	if (sel->type != SEL_NONE &&
+	    sel->p2.y >= orig + term->scroll &&
+	    sel->p1.y <= term->bot + term->scroll)
+		term_sel_stop(term);
 
-	for (i = term->bot; i >= orig + n; i--)
-		swap(term->line[i], term->line[i - n]);
+	damage_lines(term, orig + term->scroll, term->bot + term->scroll);
+}
 
-	selscroll(term, orig, n);
+void term_scroll_view(struct st_term *term, int n)
+{
+	struct st_selection *sel = &term->sel;
+	int scroll = clamp_t(int, term->scroll + n, 0, term->screen.histlen);
+
+	if (term->altscreen || scroll == term->scroll)
+		return;
+
+	n = scroll - term->scroll;
+	term->scroll = scroll;
+
+	/* the selection stays with the text, as long as it stays in view */
+	if (sel->type != SEL_NONE &&
+	    ((int) sel->p1.y + n < 0 ||
+	     (int) sel->p2.y + n >= (int) term->size.y))
+		term_sel_stop(term);
+
+	viewscroll(term, 0, term->size.y - 1, -n);
+
+	if (sel->type != SEL_NONE) {
+		sel->p1.y += n;
+		sel->p2.y += n;
+	}
 }
 
-static void tscrollup(struct st_term *term, int orig, int n)
+static void tscrolldown(struct st_term *term, int orig, int n)
 {
-	int i;
+	struct st_glyph **line = term->screen.line;
 
 	n = clamp_t(int, n, 0, term->bot - orig + 1);
 
+	term->stats.scrolls++;
+	term->stats.scrolled += n;
+
+	/* rotate the region, lines scrolling off the bottom get reused */
+	if (n) {
+		struct st_glyph *tmp[n];
+
+		memcpy(tmp, line + term->bot - n + 1, sizeof(tmp));
+		memmove(line + orig + n, line + orig,
+			(term->bot - orig + 1 - n) * sizeof(*line));
+		memcpy(line + orig, tmp, sizeof(tmp));
+	}
+
 	tclearregion(term,
 		     (struct coord) {0, orig},
 		     (struct coord) {term->size.x, orig + n});
 
-	/* XXX: optimize? */
-	for (i = orig; i <= term->bot - n; i++)
-		swap(term->line[i], term->line[i + n]);
+	if (term->scroll) {
+		tscrolledback(term, orig, -n, false);
+	} else {
+		viewscroll(term, orig, term->bot, -n);
+		selscroll(term, orig, n);
+	}
+}
+
+static void tscrollup(struct st_term *term, int orig, int n)
+{
+	struct st_glyph **line = term->screen.line;
+	bool pushed = false;
+
+	n = clamp_t(int, n, 0, term->bot - orig + 1);
+
+	term->stats.scrolls++;
+	term->stats.scrolled += n;
+
+	if (!orig && term->bot == term->size.y - 1) {
+		/* the whole screen: lines leave through the top to scrollback */
+		screen_advance(&term->screen, term->size.y, n);
+		pushed = term->screen.histsize != 0;
+	} else if (n) {
+		struct st_glyph *tmp[n];
 
-	selscroll(term, orig, -n);
+		memcpy(tmp, line + orig, sizeof(tmp));
+		memmove(line + orig, line + orig + n,
+			(term->bot - orig + 1 - n) * sizeof(*line));
+		memcpy(line + term->bot - n + 1, tmp, sizeof(tmp));
+	}
+
+	tclearregion(term,
+		     (struct coord) {0, term->bot - n + 1},
+		     (struct coord) {term->size.x, term->bot + 1});
+
+	if (term->scroll) {
+		tscrolledback(term, orig, n, pushed);
+	} else {
+		viewscroll(term, orig, term->bot, n);
+		selscroll(term, orig, -n);
+	}
 }
 
 static void tmovex(struct st_term *term, unsigned x)
@@ -415,6 +882,8 @@ static void tcursor_load(struct st_term *term)
 
 static void treset(struct st_term *term)
 {
+	term->scroll = 0;
+
 	memset(&term->c, 0, sizeof(term->c));
 	term->c.attr.cmp = 0;
 	term->c.attr.fg = term->defaultfg;
@@ -506,7 +975,7 @@ static void tsetchar(struct st_term *term, unsigned c, struct coord pos)
 	    (v = vt100_0[c - 0x41]))
 		FcUtf8ToUcs4((unsigned char *) v, &c, strlen(v));
 
-	term->dirty = true;
+	term_damage(term, pos.y, pos.x, pos.x + 1);
 	*g = term->c.attr;
 	g->c = c;
 }
@@ -523,6 +992,7 @@ static void tdeletechar(struct st_term *term, int n)
 		memmove(term_pos(term, term->c.pos),
 			term_pos(term, src),
 			size * sizeof(struct st_glyph));
+		term_damage(term, term->c.pos.y, term->c.pos.x, term->size.x);
 
 		start = term->size.x - n;
 	}
@@ -542,6 +1012,7 @@ static void tinsertblank(struct st_term *term, int n)
 		memmove(term_pos(term, dst),
 			term_pos(term, term->c.pos),
 			size * sizeof(struct st_glyph));
+		term_damage(term, term->c.pos.y, dst.x, term->size.x);
 
 		end = dst.x;
 	}
@@ -565,9 +1036,176 @@ static void tdeleteline(struct st_term *term, int n)
 	tscrollup(term, term->c.pos.y, n);
 }
 
-static void tsetattr(struct st_term *term, int *attr, int l)
+/* 24 bit colors */
+
+static unsigned truehash(uint32_t rgb)
 {
-	int i;
+	return (rgb * 2654435761U) >> 19;
+}
+
+static unsigned short *truecolor_slot(struct st_term *term, uint32_t color)
+{
+	unsigned i = truehash(color);
+
+	while (term->truehash[i] &&
+	       term->truecolor[term->truehash[i] - 1] != color)
+		i = (i + 1) & (TRUEHASH_SIZ - 1);
+
+	return &term->truehash[i];
+}
+
+static void truecolor_mark(bool *used, struct st_glyph *g, unsigned n)
+{
+	while (n--) {
+		if (g->fg >= TRUECOLOR_BASE)
+			used[g->fg - TRUECOLOR_BASE] = true;
+		if (g->bg >= TRUECOLOR_BASE)
+			used[g->bg - TRUECOLOR_BASE] = true;
+		g++;
+	}
+}
+
+/* Roughly how many cells have been written or scrolled away, ever */
+static unsigned long truecolor_churn(struct st_term *term)
+{
+	return term->stats.chars + term->stats.scrolled * term->size.x;
+}
+
+/*
+ * The table is full: free the colors no cell (or cursor) uses any more, i.e.
+ * that have scrolled out of the scrollback or been overwritten.
+ *
+ * That's a walk over the whole scrollback, so if it frees next to nothing we
+ * don't try again until a screenful of cells has changed.
+ */
+static void truecolor_gc(struct st_term *term)
+{
+	struct st_screen *screens[] = { &term->screen, &term->alt };
+	bool used[NTRUECOLOR];
+	unsigned i;
+	int y;
+
+	memset(used, 0, sizeof(used));
+
+	for (i = 0; i < ARRAY_SIZE(screens); i++)
+		for (y = -(int) screens[i]->histlen; y < (int) term->size.y; y++)
+			truecolor_mark(used, screens[i]->line[y], term->size.x);
+
+	truecolor_mark(used, &term->c.attr, 1);
+	truecolor_mark(used, &term->saved.attr, 1);
+
+	memset(term->truehash, 0, sizeof(term->truehash));
+	term->ntruecolor = 0;
+
+	for (i = 0; i < NTRUECOLOR; i++)
+		if (used[i]) {
+			*truecolor_slot(term, term->truecolor[i]) = i + 1;
+			term->ntruecolor++;
+		} else {
+			term->truecolor[i] = 0;
+		}
+
+	if (term->ntruecolor > NTRUECOLOR - NTRUECOLOR / 8)
+		term->truecolor_gc_at = truecolor_churn(term) +
+			term->size.x * term->size.y;
+}
+
+static unsigned cube6(uint32_t v)
+{
+	return ((v & 0xff) * 5 + 127) / 255;
+}
+
+/* The color index of @rgb, interning it if need be */
+static int term_truecolor(struct st_term *term, uint32_t rgb)
+{
+	uint32_t color = TRUECOLOR_USED | rgb;
+	unsigned short *slot = truecolor_slot(term, color);
+	unsigned i;
+
+	if (*slot)
+		return TRUECOLOR_BASE + *slot - 1;
+
+	if (term->ntruecolor == NTRUECOLOR &&
+	    truecolor_churn(term) >= term->truecolor_gc_at) {
+		truecolor_gc(term);
+		slot = truecolor_slot(term, color);
+	}
+
+	if (term->ntruecolor == NTRUECOLOR) {
+		/* all in use: the closest color of the 6x6x6 cube will do */
+		return 16 + 36 * cube6(rgb >> 16) +
+			6 * cube6(rgb >> 8) + cube6(rgb);
+	}
+
+	for (i = 0; term->truecolor[i]; i++)
+		;
+
+	term->truecolor[i] = color;
+	term->ntruecolor++;
+	term->truecolor_changed = true;
+	*slot = i + 1;
+
+	return TRUECOLOR_BASE + i;
+}
+
+/*
+ * 38/48 ; 5 ; n and 38/48 ; 2 ; r ; g ; b, or the same with colons - where the
+ * truecolor form may also have a color space before r. Returns the index of
+ * the last parameter used, and the color in @color, -1 if none.
+ */
+static int tsetextcolor(struct st_term *term, int *attr, bool *sub,
+			int l, int i, int *color)
+{
+	int end = i + 1, *rgb = NULL;
+
+	*color = -1;
+
+	if (end < l && sub[end]) {
+		while (end < l && sub[end])
+			end++;
+
+		if (attr[i + 1] == 5 && end - i > 2)
+			*color = attr[i + 2];
+		else if (attr[i + 1] == 2 && end - i > 4)
+			rgb = attr + end - 3;
+		else
+			fprintf(stderr, "erresc(%d): gfx attr %d unknown\n",
+				attr[i], attr[i + 1]);
+
+		i = end - 1;
+	} else if (i + 2 < l && attr[i + 1] == 5) {
+		*color = attr[i + 2];
+		i += 2;
+	} else if (i + 4 < l && attr[i + 1] == 2) {
+		rgb = attr + i + 2;
+		i += 4;
+	} else {
+		fprintf(stderr, "erresc(%d): gfx attr %d unknown\n",
+			attr[i], i + 1 < l ? attr[i + 1] : -1);
+		return i;
+	}
+
+	if (rgb) {
+		if (BETWEEN(rgb[0], 0, 255) &&
+		    BETWEEN(rgb[1], 0, 255) &&
+		    BETWEEN(rgb[2], 0, 255))
+			*color = term_truecolor(term, rgb[0] << 16 |
+						rgb[1] << 8 | rgb[2]);
+		else
+			fprintf(stderr, "erresc: bad truecolor %d;%d;%d\n",
+				rgb[0], rgb[1], rgb[2]);
+	} else if (*color >= 0 && !BETWEEN(*color, 0, 255)) {
+		fprintf(stderr, "erresc: bad color %d\n", *color);
+		*color = -1;
+	}
+
+	return i;
+}
+
+static void tsetattr(struct st_term *term, int *attr, bool *sub, int l)
+{
+	int i, color;
+	bool fg;
 	struct st_glyph *g = &term->c.attr;
 
 	for (i = 0; i < l; i++) {
@@ -588,7 +1226,9 @@ static void tsetattr(struct st_term *term, int *attr, int l)
 			g->italic	= 1;
 			break;
 		case 4:
-			g->underline	= 1;
+			/* 4:0 is no underline, other styles are all the same */
+			g->underline	= !(i + 1 < l && sub[i + 1] &&
+					    !attr[i + 1]);
 			break;
 		case 5:	/* slow blink */
 		case 6:	/* rapid blink */
@@ -615,40 +1255,20 @@ static void tsetattr(struct st_term *term, int *attr, int l)
 			g->reverse	= 0;
 			break;
 		case 38:
-			if (i + 2 < l && attr[i + 1] == 5) {
-				i += 2;
-				if (BETWEEN(attr[i], 0, 255)) {
-					term->c.attr.fg = attr[i];
-				} else {
-					fprintf(stderr,
-						"erresc: bad fgcolor %d\n",
-						attr[i]);
-				}
-			} else {
-				fprintf(stderr,
-					"erresc(38): gfx attr %d unknown\n",
-					attr[i]);
-			}
+		case 48:
+			fg = attr[i] == 38;
+			i = tsetextcolor(term, attr, sub, l, i, &color);
+			if (color < 0)
+				break;
+
+			if (fg)
+				term->c.attr.fg = color;
+			else
+				term->c.attr.bg = color;
 			break;
 		case 39:
 			term->c.attr.fg = term->defaultfg;
 			break;
-		case 48:
-			if (i + 2 < l && attr[i + 1] == 5) {
-				i += 2;
-				if (BETWEEN(attr[i], 0, 255)) {
-					term->c.attr.bg = attr[i];
-				} else {
-					fprintf(stderr,
-						"erresc: bad bgcolor %d\n",
-						attr[i]);
-				}
-			} else {
-				fprintf(stderr,
-					"erresc(48): gfx attr %d unknown\n",
-					attr[i]);
-			}
-			break;
 		case 49:
 			term->c.attr.bg = term->defaultbg;
 			break;
@@ -668,6 +1288,10 @@ static void tsetattr(struct st_term *term, int *attr, int l)
 			}
 			break;
 		}
+
+		/* skip sub-parameters we don't understand */
+		while (i + 1 < l && sub[i + 1])
+			i++;
 	}
 }
 
@@ -685,10 +1309,12 @@ static void tsetscroll(struct st_term *term, unsigned t, unsigned b)
 
 static void tswapscreen(struct st_term *term)
 {
-	swap(term->line, term->alt);
+	swap(term->screen, term->alt);
 	term->sel.type = SEL_NONE;
 	term->altscreen ^= 1;
-	term->dirty = true;
+	/* the alternate screen has no scrollback */
+	term->scroll = 0;
+	term_damage_all(term);
 }
 
 static void tsetmode(struct st_term *term, bool priv,
@@ -707,7 +1333,7 @@ static void tsetmode(struct st_term *term, bool priv,
 			case 5:	/* DECSCNM -- Reverse video */
 				if (set != term->reverse) {
 					term->reverse = set;
-					term->dirty = true;
+					term_damage_all(term);
 				}
 				break;
 			case 6:	/* DECOM -- Origin */
@@ -729,6 +1355,7 @@ static void tsetmode(struct st_term *term, bool priv,
 				break;
 			case 25:	/* DECTCEM -- Text Cursor Enable Mode */
 				term->hide = !set;
+				term->dirty = true;
 				break;
 			case 1000:	/* 1000,1002: enable xterm mouse report */
 				term->mousebtn = set;
@@ -796,6 +1423,12 @@ static void csihandle(struct st_term *term)
 {
 	struct csi_escape *csi = &term->csiescseq;
 
+	term->stats.csi[csi->mode & 0x7f]++;
+
+	/* None of the sequences below take intermediates or these markers */
+	if (csi->inter || (csi->priv && csi->priv != '?'))
+		goto unknown;
+
 	switch (csi->mode) {
 	default:
 	      unknown:
@@ -870,7 +1503,7 @@ static void csihandle(struct st_term *term)
 			tputtab(term, 1);
 		break;
 	case 'J':		/* ED -- Clear screen */
-		term->sel.type = SEL_NONE;
+		term_sel_stop(term);
 		switch (csi->arg[0]) {
 		case 0:	/* below */
 			tclearregion(term, term->c.pos, term->size);
@@ -944,7 +1577,7 @@ static void csihandle(struct st_term *term)
 		tsetmode(term, csi->priv, 1, csi->arg, csi->narg);
 		break;
 	case 'm':		/* SGR -- Terminal attribute (color) */
-		tsetattr(term, csi->arg, csi->narg);
+		tsetattr(term, csi->arg, csi->sub, csi->narg);
 		break;
 	case 'r':		/* DECSTBM -- Set Scrolling Region */
 		if (csi->priv) {
@@ -1014,6 +1647,8 @@ static void strhandle(struct st_term *term)
 	char *p = NULL;
 	int i, j, narg;
 
+	term->stats.str[esc->type & 0x7f]++;
+
 	strparse(esc);
 	narg = esc->narg;
 
@@ -1037,7 +1672,7 @@ static void strhandle(struct st_term *term)
 				break;
 
 			if (term->setcolorname(term, j, p))
-				term->dirty = true;
+				term_damage_all(term);
 			else
 				fprintf(stderr,
 					"erresc: invalid color %s\n", p);
@@ -1069,6 +1704,8 @@ static void tputc(struct st_term *term, unsigned c)
 {
 	bool control = c < '\x20' || c == 0177;
 
+	term->stats.chars++;
+
 	/*
 	 * STR sequences must be checked before anything else
 	 * because it can use some control codes as part of the sequence.
@@ -1154,6 +1791,7 @@ static void tputc(struct st_term *term, unsigned c)
 		case '\032':	/* SUB */
 		case '\030':	/* CAN */
 			csireset(&term->csiescseq);
+			term->esc = 0;
 			return;
 		case '\005':	/* ENQ (IGNORED) */
 		case '\000':	/* NUL (IGNORED) */
@@ -1164,12 +1802,10 @@ static void tputc(struct st_term *term, unsigned c)
 		}
 	} else if (term->esc & ESC_START) {
 		if (term->esc & ESC_CSI) {
-			term->csiescseq.buf[term->csiescseq.len++] = c;
-			if (BETWEEN(c, 0x40, 0x7E)
-			    || term->csiescseq.len >= sizeof(term->csiescseq.buf) - 1) {
+			if (csiparse(&term->csiescseq, c)) {
 				term->esc = 0;
-				csiparse(&term->csiescseq);
-				csihandle(term);
+				if (term->csiescseq.mode)
+					csihandle(term);
 			}
 		} else if (term->esc & ESC_STR_END) {
 			term->esc = 0;
@@ -1302,16 +1938,19 @@ static void tputc(struct st_term *term, unsigned c)
 		return;
 
 	if (term->sel.type != SEL_NONE &&
-	    BETWEEN(term->c.pos.y, term->sel.p1.y, term->sel.p2.y))
-		term->sel.type = SEL_NONE;
+	    BETWEEN(term->c.pos.y + term->scroll,
+		    term->sel.p1.y, term->sel.p2.y))
+		term_sel_stop(term);
 
 	if (term->wrap && term->c.wrapnext)
 		tnewline(term, 1);	/* always go to first col */
 
-	if (term->insert && term->c.pos.x + 1 < term->size.x)
+	if (term->insert && term->c.pos.x + 1 < term->size.x) {
 		memmove(term_pos(term, term->c.pos) + 1,
 			term_pos(term, term->c.pos),
 			(term->size.x - term->c.pos.x - 1) * sizeof(struct st_glyph));
+		term_damage(term, term->c.pos.y, term->c.pos.x, term->size.x);
+	}
 
 	tsetchar(term, c, term->c.pos);
 	if (term->c.pos.x + 1 < term->size.x)
@@ -1320,6 +1959,185 @@ static void tputc(struct st_term *term, unsigned c)
 		term->c.wrapnext = 1;
 }
 
+/*
+ * Length of the leading span of printable ASCII (0x20 - 0x7e) in @p - i.e. up
+ * to the first control byte, DEL, ESC or byte with the high bit set.
+ */
+static unsigned asciispan_scalar(const unsigned char *p, unsigned len)
+{
+	unsigned i;
+
+	for (i = 0; i < len; i++)
+		if (p[i] < '\x20' || p[i] >= 0177)
+			break;
+
+	return i;
+}
+
+#ifdef __SSE2__
+/*
+ * As signed bytes, everything with the high bit set is negative, so a single
+ * pair of compares catches both ends of the range:
+ */
+static unsigned asciispan_sse2(const unsigned char *p, unsigned len)
+{
+	const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+	unsigned i, mask;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, lo),
+						       _mm_cmplt_epi8(v, hi)));
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + asciispan_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned asciispan_avx2(const unsigned char *p, unsigned len)
+{
+	const __m256i lo = _mm256_set1_epi8(0x1f), hi = _mm256_set1_epi8(0x7f);
+	unsigned i, mask;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+
+		mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpgt_epi8(v, lo),
+							     _mm256_cmpgt_epi8(hi, v)));
+		if (mask != ~0U)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + asciispan_sse2(p + i, len - i);
+}
+
+static unsigned (*asciispan)(const unsigned char *, unsigned) = asciispan_sse2;
+
+static void asciispan_init(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		asciispan = asciispan_avx2;
+}
+#else
+#define asciispan		asciispan_scalar
+static void asciispan_init(void) {}
+#endif
+
+/* Whether @len bytes are the start of a utf8 char that goes on past them */
+static bool utf8_cut(const unsigned char *p, unsigned len)
+{
+	unsigned need = *p >= 0xf0 ? 4 : *p >= 0xe0 ? 3 : *p >= 0xc0 ? 2 : 1;
+	unsigned i;
+
+	if (*p > 0xf7 || len >= need)
+		return false;
+
+	for (i = 1; i < len; i++)
+		if ((p[i] & 0xc0) != 0x80)
+			return false;
+
+	return true;
+}
+
+/*
+ * Decodes the next character of a printable run, returns its length or 0 if it
+ * has to go through tputc().
+ */
+static int runchar(unsigned char *p, unsigned char *end, unsigned *ucs)
+{
+	int charsize;
+
+	if (*p < 0x80) {
+		*ucs = *p;
+		return *p < '\x20' || *p == 0177 ? 0 : 1;
+	}
+
+	charsize = FcUtf8ToUcs4(p, ucs, end - p);
+	if (charsize < 0) {
+		if (utf8_cut(p, end - p))
+			return 0;
+
+		charsize = 1;
+		*ucs = *p;
+	}
+
+	if (*ucs < '\x20' || *ucs == 0177)
+		return 0;
+
+	return charsize;
+}
+
+/*
+ * Fast path for runs of printable characters: writes as many as fit before the
+ * wrap column straight into the line, and returns the number of bytes
+ * consumed. Anything tputc() would have to think about - escape sequences,
+ * control codes, insert mode, the graphic charset - ends the run.
+ */
+static unsigned tputrun(struct st_term *term, unsigned char *buf, unsigned len)
+{
+	unsigned char *p = buf, *end = buf + len;
+	struct st_glyph *line, g = term->c.attr;
+	unsigned x, x1, ucs;
+	int charsize;
+
+	if (term->esc || term->insert || g.gfx ||
+	    (term->c.wrapnext && !term->wrap) ||
+	    !(charsize = runchar(p, end, &ucs)))
+		return 0;
+
+	if (term->sel.type != SEL_NONE &&
+	    BETWEEN(term->c.pos.y + term->scroll,
+		    term->sel.p1.y, term->sel.p2.y))
+		term_sel_stop(term);
+
+	if (term->c.wrapnext)
+		tnewline(term, 1);
+
+	line = term_pos(term, (struct coord) { 0, term->c.pos.y });
+	x = x1 = term->c.pos.x;
+
+	while (1) {
+		unsigned i, n = asciispan(p, min_t(unsigned, end - p,
+						   term->size.x - x));
+
+		for (i = 0; i < n; i++) {
+			g.c = p[i];
+			line[x + i] = g;
+		}
+
+		x += n;
+		p += n;
+
+		if (p == end || x == term->size.x ||
+		    !(charsize = runchar(p, end, &ucs)))
+			break;
+
+		g.c = ucs;
+		line[x++] = g;
+		p += charsize;
+
+		if (p == end || x == term->size.x)
+			break;
+	}
+
+	term_damage(term, term->c.pos.y, x1, x);
+	term->dirty = true;
+	term->stats.chars += x - x1;
+
+	if (x < term->size.x) {
+		term->c.pos.x = x;
+	} else {
+		term->c.pos.x = term->size.x - 1;
+		term->c.wrapnext = 1;
+	}
+
+	return p - buf;
+}
+
 void term_echo(struct st_term *term, char *buf, int len)
 {
 	for (; len > 0; buf++, len--) {
@@ -1346,51 +2164,187 @@ void term_echo(struct st_term *term, char *buf, int len)
 	}
 }
 
-void term_read(struct st_term *term)
+/*
+ * Reads what the shell has written into cmdbuf; returns what read() did: the
+ * number of bytes, 0 when the shell has gone away, -1 with errno set on errors
+ * - EAGAIN when there's nothing more for now. Touches nothing but cmdbuf, so
+ * it can run without whatever lock the caller has around the rest of the
+ * terminal.
+ */
+ssize_t term_fill(struct st_term *term)
 {
-	unsigned char *ptr;
-	int ret;
-
-	/* append read bytes to unprocessed bytes */
-	while ((ret = read(term->cmdfd,
+	ssize_t ret = read(term->cmdfd,
 			   term->cmdbuf + term->cmdbuflen,
-			   sizeof(term->cmdbuf) - term->cmdbuflen)) > 0) {
-		if (term->logfd != -1 &&
-		    xwrite(term->logfd, term->cmdbuf + term->cmdbuflen, ret) < 0) {
-			fprintf(stderr, "Error writing in %s:%s\n",
-				term->logfile, strerror(errno));
-			close(term->logfd);
-			term->logfd = -1;
-		}
+			   sizeof(term->cmdbuf) - term->cmdbuflen);
 
-		/* process every complete utf8 char */
-		term->cmdbuflen += ret;
-		ptr = term->cmdbuf;
+	if (ret <= 0)
+		return ret;
 
-		while (term->cmdbuflen) {
-			unsigned ucs;
-			int charsize = FcUtf8ToUcs4(ptr, &ucs, term->cmdbuflen);
-			if (charsize < 0) {
-				charsize = 1;
-				ucs = *ptr;
-			}
+	if (term->logfd != -1 &&
+	    xwrite(term->logfd, term->cmdbuf + term->cmdbuflen, ret) < 0) {
+		fprintf(stderr, "Error writing in %s:%s\n",
+			term->logfile, strerror(errno));
+		close(term->logfd);
+		term->logfd = -1;
+	}
+
+	term->cmdbuflen += ret;
+	term->stats.reads++;
+	term->stats.bytes += ret;
+	return ret;
+}
+
+/* Process every complete utf8 char in cmdbuf */
+void term_parse(struct st_term *term)
+{
+	unsigned char *ptr = term->cmdbuf;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (term->cmdbuflen) {
+		unsigned ucs, run;
+		int charsize;
+
+		run = tputrun(term, ptr, term->cmdbuflen);
+		if (run) {
+			ptr += run;
+			term->cmdbuflen -= run;
+			continue;
+		}
 
-			if (charsize > term->cmdbuflen)
+		charsize = FcUtf8ToUcs4(ptr, &ucs, term->cmdbuflen);
+		if (charsize < 0) {
+			if (utf8_cut(ptr, term->cmdbuflen))
 				break;
 
-			tputc(term, ucs);
-			ptr += charsize;
-			term->cmdbuflen -= charsize;
+			charsize = 1;
+			ucs = *ptr;
+		}
+
+		tputc(term, ucs);
+		ptr += charsize;
+		term->cmdbuflen -= charsize;
+	}
+
+	/* keep any uncomplete utf8 char for the next call */
+	memmove(term->cmdbuf, ptr, term->cmdbuflen);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	term->stats.parse_us += (end.tv_sec - start.tv_sec) * 1000000 +
+		(end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+/*
+ * Parses @len bytes as if the shell had written them, for driving the terminal
+ * without one; any replies are left queued in term->out.
+ */
+void term_feed(struct st_term *term, const char *buf, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = min_t(size_t, len, sizeof(term->cmdbuf) - term->cmdbuflen);
+		memcpy(term->cmdbuf + term->cmdbuflen, buf, n);
+		term->cmdbuflen += n;
+		buf += n;
+		len -= n;
+
+		term_parse(term);
+	}
+}
+
+/*
+ * Reads and parses what the shell has written, but only for @budget
+ * microseconds - checked after every read, so at most BUFSIZ bytes late. A
+ * flood can't keep the caller from its other work that way; whatever is left
+ * in the pty or in cmdbuf keeps until the next call.
+ *
+ * Returns what the last term_fill() did.
+ */
+ssize_t term_read(struct st_term *term, unsigned budget)
+{
+	struct timespec start, now;
+	ssize_t ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while ((ret = term_fill(term)) > 0) {
+		term_parse(term);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start.tv_sec) * 1000000 +
+		    (now.tv_nsec - start.tv_nsec) / 1000 >= budget)
+			break;
+	}
+
+	return ret;
+}
+
+/*
+ * Queues bytes for the shell, to go out with the next term_flush(): keys,
+ * mouse reports, replies and pastes all line up here, so a shell that isn't
+ * reading can't block us or make us drop anything.
+ */
+void ttywrite(struct st_term *term, const char *s, size_t n)
+{
+	struct st_ttyq *q = &term->out;
+	size_t tail, part;
+
+	if (!n)
+		return;
+
+	if (q->len + n > q->size) {
+		size_t size = q->size ?: 4096;
+
+		while (size < q->len + n)
+			size *= 2;
+
+		/* what wrapped around goes after the old end */
+		part = min(q->len, q->size - q->head);
+		q->buf = xrealloc(q->buf, size);
+		memcpy(q->buf + q->size, q->buf, q->len - part);
+		q->size = size;
+	}
+
+	tail = (q->head + q->len) & (q->size - 1);
+	part = min(n, q->size - tail);
+	memcpy(q->buf + tail, s, part);
+	memcpy(q->buf, s + part, n - part);
+	q->len += n;
+}
+
+/*
+ * Writes as much of the queue as the pty takes, both ends of the ring in one
+ * go; returns how much is left, for the caller to wait for the pty to be
+ * writable again, or -1 with errno set if writing failed.
+ */
+ssize_t term_flush(struct st_term *term)
+{
+	struct st_ttyq *q = &term->out;
+	struct iovec iov[2];
+	size_t part;
+	ssize_t ret;
+
+	while (q->len) {
+		part = min(q->len, q->size - q->head);
+		iov[0] = (struct iovec) { q->buf + q->head, part };
+		iov[1] = (struct iovec) { q->buf, q->len - part };
+
+		ret = writev(term->cmdfd, iov, part < q->len ? 2 : 1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return -1;
 		}
 
-		/* keep any uncomplete utf8 char for the next call */
-		memmove(term->cmdbuf, ptr, term->cmdbuflen);
+		q->head = (q->head + ret) & (q->size - 1);
+		q->len -= ret;
 	}
 
-	if (!ret)
-		exit(EXIT_SUCCESS);
-	else if (errno != EAGAIN)
-		edie("Couldn't read from shell");
+	return q->len;
 }
 
 void term_mousereport(struct st_term *term, struct coord pos,
@@ -1400,7 +2354,7 @@ void term_mousereport(struct st_term *term, struct coord pos,
 	int len;
 
 	/* from urxvt */
-	if (type == MotionNotify) {
+	if (type == MOUSE_MOTION) {
 		if (!term->mousemotion ||
 		    (pos.x == term->mousepos.x &&
 		     pos.y == term->mousepos.y))
@@ -1409,27 +2363,27 @@ void term_mousereport(struct st_term *term, struct coord pos,
 		button = term->mousebutton + 32;
 		term->mousepos = pos;
 	} else if (!term->mousesgr &&
-		   (type == ButtonRelease ||
-		    button == AnyButton)) {
+		   (type == MOUSE_RELEASE ||
+		    button == MOUSE_ANYBUTTON)) {
 		button = 3;
 	} else {
-		button -= Button1;
+		button -= 1;
 		if (button >= 3)
 			button += 64 - 3;
-		if (type == ButtonPress) {
+		if (type == MOUSE_PRESS) {
 			term->mousebutton = button;
 			term->mousepos = pos;
 		}
 	}
 
-	button += (state & ShiftMask ? 4 : 0) +
-		(state & Mod4Mask ? 8 : 0) +
-		(state & ControlMask ? 16 : 0);
+	button += (state & MOUSE_SHIFT ? 4 : 0) +
+		(state & MOUSE_META ? 8 : 0) +
+		(state & MOUSE_CTRL ? 16 : 0);
 
 	if (term->mousesgr)
 		len = snprintf(buf, sizeof(buf), "\033[<%d;%d;%d%c",
 			       button, pos.x + 1, pos.y + 1,
-			       type == ButtonRelease ? 'm' : 'M');
+			       type == MOUSE_RELEASE ? 'm' : 'M');
 	else if (pos.x < 223 && pos.y < 223)
 		len = snprintf(buf, sizeof(buf), "\033[M%c%c%c",
 			       32 + button, 32 + pos.x + 1, 32 + pos.y + 1);
@@ -1439,6 +2393,33 @@ void term_mousereport(struct st_term *term, struct coord pos,
 	ttywrite(term, buf, len);
 }
 
+/* Escape sequences, by the character that says which */
+static void stats_escapes(FILE *f, const char *what, unsigned long *counts)
+{
+	unsigned i;
+
+	fprintf(f, "%s:", what);
+	for (i = 0; i < 128; i++)
+		if (counts[i])
+			fprintf(f, isgraph(i) ? " %c %lu" : " \\x%02x %lu",
+				i, counts[i]);
+	fprintf(f, "\n");
+}
+
+void term_stats(struct st_term *term, FILE *f)
+{
+	struct st_stats *s = &term->stats;
+
+	fprintf(f, "read: %lu bytes in %lu reads\n"
+		"parse: %lu chars in %lu.%03lu ms\n"
+		"scroll: %lu lines in %lu scrolls\n",
+		s->bytes, s->reads,
+		s->chars, s->parse_us / 1000, s->parse_us % 1000,
+		s->scrolled, s->scrolls);
+	stats_escapes(f, "csi", s->csi);
+	stats_escapes(f, "str", s->str);
+}
+
 /* Resize code */
 
 static void ttyresize(struct st_term *term)
@@ -1450,68 +2431,36 @@ static void ttyresize(struct st_term *term)
 	w.ws_xpixel = term->ttysize.x;
 	w.ws_ypixel = term->ttysize.y;
 
+	if (term->cmdfd < 0)
+		return;
+
 	if (ioctl(term->cmdfd, TIOCSWINSZ, &w) < 0)
 		perror("Couldn't set window size");
 }
 
 void term_resize(struct st_term *term, struct coord size)
 {
-	unsigned i, x;
-	unsigned minrow = min(size.y, term->size.y);
-	int slide = term->c.pos.y - size.y + 1;
+	unsigned i;
+	int slide = max(0, (int) term->c.pos.y - (int) size.y + 1);
 	bool *bp;
 
 	if (size.x < 1 || size.y < 1)
 		return;
 
-	/* free unneeded rows */
-	i = 0;
-	if (slide > 0) {
-		/*
-		 * slide screen to keep cursor where we expect it -
-		 * tscrollup would work here, but we can optimize to
-		 * memmove because we're freeing the earlier lines
-		 */
-		for ( /* i = 0 */ ; i < slide; i++) {
-			free(term->line[i]);
-			free(term->alt[i]);
-		}
-		memmove(term->line, term->line + slide,
-			size.y * sizeof(struct st_glyph *));
-		memmove(term->alt, term->alt + slide,
-			size.y * sizeof(struct st_glyph *));
-	}
-	for (i += size.y; i < term->size.y; i++) {
-		free(term->line[i]);
-		free(term->alt[i]);
-	}
+	/* the cells under it are about to go: keep the text, drop the rest */
+	term_sel_stop(term);
 
-	/* resize to new height */
-	term->line = xrealloc(term->line, size.y * sizeof(struct st_glyph *));
-	term->alt = xrealloc(term->alt, size.y * sizeof(struct st_glyph *));
-	term->tabs = xrealloc(term->tabs, size.x * sizeof(*term->tabs));
-
-	/* resize each row to new width, zero-pad if needed */
-	for (i = 0; i < minrow; i++) {
-		term->line[i] = xrealloc(term->line[i], size.x * sizeof(struct st_glyph));
-		term->alt[i] = xrealloc(term->alt[i], size.x * sizeof(struct st_glyph));
+	term->scroll = 0;
 
-		for (x = term->size.x; x < size.x; x++) {
-			term->line[i][x] = term->c.attr;
-			term->alt[i][x] = term->c.attr;
-		}
-	}
-
-	/* allocate any new rows */
-	for ( /* i == minrow */ ; i < size.y; i++) {
-		term->line[i] = xcalloc(size.x, sizeof(struct st_glyph));
-		term->alt[i] = xcalloc(size.x, sizeof(struct st_glyph));
+	/*
+	 * slide screen to keep cursor where we expect it - the lines that
+	 * don't fit anymore go to scrollback
+	 */
+	screen_resize(&term->screen, term->size, size, slide, term->c.attr);
+	screen_resize(&term->alt, term->size, size, slide, term->c.attr);
 
-		for (x = 0; x < size.x; x++) {
-			term->line[i][x] = term->c.attr;
-			term->alt[i][x] = term->c.attr;
-		}
-	}
+	term->tabs = xrealloc(term->tabs, size.x * sizeof(*term->tabs));
+	term->damage = xrealloc(term->damage, size.y * sizeof(struct damage));
 
 	if (size.x > term->size.x) {
 		bp = term->tabs + term->size.x;
@@ -1525,6 +2474,10 @@ void term_resize(struct st_term *term, struct coord size)
 	}
 	/* update terminal size */
 	term->size = size;
+	/* everything moved, repaint it all */
+	for (i = 0; i < size.y; i++)
+		term->damage[i] = NODAMAGE;
+	term_damage_all(term);
 	/* reset scrolling region */
 	tsetscroll(term, 0, size.y - 1);
 	/* make use of the LIMIT in tmoveto */
@@ -1533,13 +2486,28 @@ void term_resize(struct st_term *term, struct coord size)
 	ttyresize(term);
 }
 
+/*
+ * Frees what term_init() and everything since allocated; the shell, if any,
+ * and the fds are the caller's business - see term_shutdown().
+ */
+void term_free(struct st_term *term)
+{
+	screen_free(&term->screen);
+	screen_free(&term->alt);
+	free(term->tabs);
+	free(term->damage);
+	free(term->out.buf);
+	clip_put(term->sel.clip);
+}
+
 /* Startup */
 
 static pid_t pid;
 
 void term_shutdown(struct st_term *term)
 {
-	kill(pid, SIGHUP);
+	if (pid)
+		kill(pid, SIGHUP);
 }
 
 static void execsh(unsigned long windowid, char *shell, char **cmd)
@@ -1591,13 +2559,14 @@ static void sigchld(int a)
 		exit(EXIT_FAILURE);
 }
 
-static void term_ttyinit(struct st_term *term, unsigned long windowid,
-			 char *shell, char **cmd)
+/* Starts the shell on a new pty, and logs what it writes to @logfile */
+void term_spawn(struct st_term *term, char *shell, char **cmd,
+		const char *logfile, unsigned long windowid)
 {
 	int master, slave, flags;
 	struct winsize w = { term->size.y, term->size.x, 0, 0 };
 
-	term->logfd = -1;
+	term->logfile = logfile;
 
 	/* seems to work fine on linux, openbsd and freebsd */
 	if (openpty(&master, &slave, NULL, NULL, &w) < 0)
@@ -1641,11 +2610,19 @@ static void term_ttyinit(struct st_term *term, unsigned long windowid,
 	}
 }
 
-void term_init(struct st_term *term, int col, int row, char *shell,
-	       char **cmd, const char *logfile, unsigned long windowid,
-	       unsigned defaultfg, unsigned defaultbg, unsigned defaultcs)
+/*
+ * Sets up a terminal with no shell: term_spawn() starts one, or whatever is
+ * driving it feeds it with term_feed() and reads the cells back with
+ * term_line() and term_snapshot(), or sets cmdfd to an fd of its own.
+ */
+void term_init(struct st_term *term, int col, int row,
+	       unsigned defaultfg, unsigned defaultbg, unsigned defaultcs,
+	       unsigned histsize)
 {
-	term->logfile	= logfile;
+	asciispan_init();
+
+	term->cmdfd	= -1;
+	term->logfd	= -1;
 	term->defaultfg = defaultfg;
 	term->defaultbg = defaultbg;
 	term->defaultcs = defaultcs;
@@ -1653,17 +2630,15 @@ void term_init(struct st_term *term, int col, int row, char *shell,
 	/* set screen size */
 	term->size.y = row;
 	term->size.x = col;
-	term->line = xcalloc(term->size.y, sizeof(struct st_glyph *));
-	term->alt = xcalloc(term->size.y, sizeof(struct st_glyph *));
+	screen_init(&term->screen, term->size, histsize);
+	screen_init(&term->alt, term->size, 0);
 	term->tabs = xcalloc(term->size.x, sizeof(*term->tabs));
+	term->damage = xcalloc(term->size.y, sizeof(struct damage));
 
-	for (row = 0; row < term->size.y; row++) {
-		term->line[row] = xcalloc(term->size.x, sizeof(struct st_glyph));
-		term->alt[row] = xcalloc(term->size.x, sizeof(struct st_glyph));
-	}
+	for (row = 0; row < term->size.y; row++)
+		term->damage[row] = NODAMAGE;
 
 	term->numlock = 1;
 	/* setup screen */
 	treset(term);
-	term_ttyinit(term, windowid, shell, cmd);
 }
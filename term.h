@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,6 +21,11 @@
 	(void) (&_max1 == &_max2);		\
 	_max1 > _max2 ? _max1 : _max2; })
 
+#define min_t(type, x, y) ({			\
+	type _min1 = (x);			\
+	type _min2 = (y);			\
+	_min1 < _min2 ? _min1 : _min2; })
+
 #define clamp(val, min, max) ({			\
 	typeof(val) __val = (val);		\
 	typeof(min) __min = (min);		\
@@ -63,12 +69,23 @@
 
 #define UTF_SIZ       4
 #define ESC_BUF_SIZ   (128*UTF_SIZ)
-#define ESC_ARG_SIZ   16
+#define ESC_ARG_SIZ   32
+#define ESC_ARG_MAX   65535
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
 
 #define VT102ID "\033[?6c"
 
+/*
+ * Colors of a cell at or above TRUECOLOR_BASE are 24 bit colors, interned in a
+ * table per terminal - the 12 bit color fields of a cell don't have room for
+ * anything more:
+ */
+#define TRUECOLOR_BASE	512
+#define NTRUECOLOR	(4096 - TRUECOLOR_BASE)
+#define TRUECOLOR_USED	(1U << 24)
+#define TRUEHASH_SIZ	8192
+
 enum escape_state {
 	ESC_START = 1,
 	ESC_CSI = 2,
@@ -99,6 +116,21 @@ struct coord {
 	unsigned	x, y;
 };
 
+/* Damaged columns [x1, x2) of a row; empty when x1 >= x2 */
+struct damage {
+	unsigned	x1, x2;
+};
+
+#define NODAMAGE	(struct damage) {~0U, 0}
+
+/* Lines [top, bot] moved up by n (down, if negative) */
+struct scroll {
+	unsigned	top, bot;
+	int		n;
+};
+
+#define SCROLL_LOG_SIZ	16
+
 #define ORIGIN	(struct coord) {0, 0}
 
 struct tcursor {
@@ -109,12 +141,13 @@ struct tcursor {
 };
 
 /* CSI Escape sequence structs */
-/* ESC '[' [[ [<priv>] <arg> [;]] <mode>] */
+/* ESC '[' [<priv>] [<arg> [;|: <arg>]...] [<inter>] <mode> */
 struct csi_escape {
-	char		buf[ESC_BUF_SIZ]; /* raw string */
-	int		len;		/* raw string length */
-	char		priv;
+	unsigned char	state;		/* parser state, see csiparse() */
+	char		priv;		/* private marker: < = > ? */
+	char		inter;		/* intermediate byte */
 	int		arg[ESC_ARG_SIZ];
+	bool		sub[ESC_ARG_SIZ]; /* arg follows a ':' */
 	int		narg;		/* nb of args */
 	char		mode;
 };
@@ -129,6 +162,16 @@ struct str_escape {
 	int		narg;		/* nb of args */
 };
 
+/*
+ * Selected text, nul terminated; refcounted, as sending it somewhere can take
+ * longer than the selection stays the same:
+ */
+struct st_clip {
+	unsigned	refs;
+	size_t		len, size;
+	char		data[];
+};
+
 struct st_selection {
 	enum {
 		SEL_NONE,
@@ -138,23 +181,77 @@ struct st_selection {
 
 	struct coord	p1, p2;
 
-	char		*clip;
+	/* the text, made when asked for, see term_sel_text() */
+	struct st_clip	*clip;
+	bool		dirty;		/* cells or ends changed since */
+};
+
+/*
+ * The lines of a screen and its scrollback, all in one allocation. @line is a
+ * window into a bigger array of line pointers, with the scrollback lines right
+ * before it, oldest first: scrolling the whole screen up is mostly advancing
+ * @line, and moving lines around is moving pointers.
+ */
+struct st_screen {
+	struct st_glyph	**line;	/* lines of the screen */
+	struct st_glyph	**index; /* all line pointers, @line points into it */
+	unsigned	nindex;
+	struct st_glyph	*glyphs; /* storage for all lines */
+	unsigned	histsize; /* lines of scrollback */
+	unsigned	histlen; /* lines of scrollback in use */
+};
+
+/*
+ * Bytes on their way to the shell, a ring buffer: ttywrite() queues them,
+ * term_flush() writes what the pty will take.
+ */
+struct st_ttyq {
+	char		*buf;
+	size_t		size;	/* power of two */
+	size_t		head;
+	size_t		len;
 };
 
+/*
+ * Counters for where the time goes, see term_stats(). reads and bytes are
+ * counted by term_fill(), which runs without the caller's lock, so a dump
+ * taken while another thread reads may be a read behind on those two.
+ */
+struct st_stats {
+	unsigned long	reads;		/* read()s that got something */
+	unsigned long	bytes;		/* read from the shell */
+	unsigned long	chars;		/* code points parsed */
+	unsigned long	csi[128];	/* CSI sequences, by final byte */
+	unsigned long	str[128];	/* OSC, DCS, ... by type */
+	unsigned long	scrolls;
+	unsigned long	scrolled;	/* lines */
+	unsigned long	parse_us;
+};
+
+/* Pastes stop reading more once this much is waiting for the shell */
+#define TTYQ_MAX	(64 * 1024)
+
 /* Internal representation of the screen */
 struct st_term {
 	int		cmdfd;
 	unsigned char	cmdbuf[BUFSIZ];
 	unsigned	cmdbuflen;
+	struct st_ttyq	out;
 
 	int		logfd;
 	const char	*logfile;
 
 	struct coord	size;
 	struct coord	ttysize; /* kill? */
-	struct st_glyph	**line;	/* screen */
-	struct st_glyph	**alt;	/* alternate screen */
-	bool		dirty;	/* dirtyness of lines */
+	struct st_screen screen; /* current screen */
+	struct st_screen alt;	/* the other screen */
+	unsigned	scroll;	/* lines the view is scrolled back */
+
+	/* damage is relative to the view, not the screen: */
+	bool		dirty;	/* needs redraw: damage or cursor change */
+	struct damage	*damage; /* damaged columns of each line */
+	struct scroll	scrolls[SCROLL_LOG_SIZ]; /* since the last frame */
+	unsigned	nscrolls;
 	bool		*tabs;
 
 	struct tcursor	c;	/* cursor */
@@ -189,27 +286,81 @@ struct st_term {
 	unsigned short	defaultbg;
 	unsigned short	defaultcs;
 
+	uint32_t	truecolor[NTRUECOLOR]; /* TRUECOLOR_USED | rgb */
+	unsigned short	truehash[TRUEHASH_SIZ]; /* index + 1, 0 if empty */
+	unsigned	ntruecolor;	/* in use */
+	unsigned long	truecolor_gc_at; /* no gc until truecolor_churn() gets here */
+	bool		truecolor_changed; /* since the last snapshot */
+
+	struct st_stats	stats;
+
 	int		(*setcolorname)(struct st_term *, int, const char *);
 	void		(*settitle)(struct st_term *, char *);
 	void		(*seturgent)(struct st_term *, int);
 };
 
+/*
+ * A copy of the view, with the selection applied, for drawing without holding
+ * on to the terminal; term_snapshot() brings it up to date and hands over the
+ * damage and scrolls since the last one:
+ */
+struct st_snapshot {
+	struct coord	size;
+	struct st_glyph	**line;
+	struct st_glyph	*glyphs;
+	struct damage	*damage;
+	struct scroll	scrolls[SCROLL_LOG_SIZ];
+	unsigned	nscrolls;
+	struct coord	cursor;	/* in view coordinates */
+	bool		hide;	/* cursor hidden */
+	bool		reverse;
+	uint32_t	truecolor[NTRUECOLOR]; /* as of the last snapshot */
+};
+
 bool term_selected(struct st_selection *, int, int);
 void term_sel_update(struct st_term *, unsigned, struct coord, struct coord);
 void term_sel_stop(struct st_term *);
+struct st_clip *term_sel_text(struct st_term *);
 void term_sel_word(struct st_term *, struct coord);
 void term_sel_line(struct st_term *, struct coord);
 
 void term_echo(struct st_term *, char *, int);
-void term_read(struct st_term *);
+ssize_t term_read(struct st_term *, unsigned);
+ssize_t term_fill(struct st_term *);
+void ttywrite(struct st_term *, const char *, size_t);
+ssize_t term_flush(struct st_term *);
+void term_parse(struct st_term *);
+void term_feed(struct st_term *, const char *, size_t);
+
+/* For term_mousereport(): buttons are numbered from 1, as in X */
+enum {
+	MOUSE_PRESS,
+	MOUSE_RELEASE,
+	MOUSE_MOTION,
+};
+
+#define MOUSE_ANYBUTTON	0
+
+#define MOUSE_SHIFT	(1 << 0)
+#define MOUSE_META	(1 << 1)
+#define MOUSE_CTRL	(1 << 2)
+
 void term_mousereport(struct st_term *, struct coord,
 		      unsigned, unsigned, unsigned);
+void term_stats(struct st_term *, FILE *);
+
+void term_damage_all(struct st_term *term);
+void term_snapshot(struct st_term *term, struct st_snapshot *snap);
+void term_scroll_view(struct st_term *term, int n);
 
 void term_resize(struct st_term *term, struct coord size);
 void term_shutdown(struct st_term *term);
-void term_init(struct st_term *term, int col, int row, char *shell,
-	       char **cmd, const char *logfile, unsigned long windowid,
-	       unsigned defaultfg, unsigned defaultbg, unsigned defaultcs);
+void term_spawn(struct st_term *term, char *shell, char **cmd,
+		const char *logfile, unsigned long windowid);
+void term_init(struct st_term *term, int col, int row,
+	       unsigned defaultfg, unsigned defaultbg, unsigned defaultcs,
+	       unsigned histsize);
+void term_free(struct st_term *term);
 
 /* Random utility code */
 
@@ -276,13 +427,56 @@ static inline void *xcalloc(size_t nmemb, size_t size)
 	return p;
 }
 
-static inline void ttywrite(struct st_term *term, const char *s, size_t n)
+static inline struct st_clip *clip_get(struct st_clip *clip)
+{
+	clip->refs++;
+	return clip;
+}
+
+static inline void clip_put(struct st_clip *clip)
+{
+	if (clip && !--clip->refs)
+		free(clip);
+}
+
+/* Damage columns [x1, x2) of line y of the view */
+static inline void term_damage_view(struct st_term *term, unsigned y,
+				    unsigned x1, unsigned x2)
 {
-	if (write(term->cmdfd, s, n) == -1)
-		die("write error on tty: %s\n", strerror(errno));
+	struct damage *d = &term->damage[y];
+
+	if (x1 >= x2)
+		return;
+
+	if (term->sel.type != SEL_NONE &&
+	    BETWEEN(y, term->sel.p1.y, term->sel.p2.y))
+		term->sel.dirty = true;
+
+	d->x1 = min(d->x1, x1);
+	d->x2 = max(d->x2, x2);
+	term->dirty = true;
+}
+
+/* Damage columns [x1, x2) of line y of the screen, if it's in view */
+static inline void term_damage(struct st_term *term, unsigned y,
+			       unsigned x1, unsigned x2)
+{
+	y += term->scroll;
+
+	if (y < term->size.y)
+		term_damage_view(term, y, x1, x2);
 }
 
 static inline struct st_glyph *term_pos(struct st_term *term, struct coord pos)
 {
-	return &term->line[pos.y][pos.x];
+	return &term->screen.line[pos.y][pos.x];
+}
+
+/*
+ * Line y of the view - when scrolled back, the view starts with the last
+ * @scroll lines of scrollback:
+ */
+static inline struct st_glyph *term_line(struct st_term *term, unsigned y)
+{
+	return term->screen.line[(int) y - (int) term->scroll];
 }
@@ -0,0 +1,181 @@
+/*
+ * Checks of the terminal on its own, no X and no shell: make check. Each test
+ * gets a fresh terminal, feeds it with term_feed() and looks at the result.
+ */
+
+#include <fcntl.h>
+
+#include "term.h"
+
+static unsigned failed;
+
+#define check(cond)							\
+do {									\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s failed\n",			\
+			__func__, __LINE__, #cond);			\
+		failed++;						\
+	}								\
+} while (0)
+
+static void feed(struct st_term *term, const char *s)
+{
+	term_feed(term, s, strlen(s));
+}
+
+static void fill(struct st_term *term)
+{
+	unsigned y;
+
+	feed(term, "\033[H");
+	for (y = 0; y < term->size.y; y++) {
+		unsigned x;
+
+		for (x = 0; x < term->size.x; x++)
+			term_feed(term, &"abcdefghijklmnopqrstuvwxyz"[(x + y) % 26], 1);
+	}
+}
+
+/* The text is made when asked for, kept until the cells change */
+static void test_sel_text(void)
+{
+	struct st_term term = { 0 };
+	struct st_clip *clip, *held;
+
+	term_init(&term, 20, 5, 7, 0, 256, 0);
+	feed(&term, "hello w\xc3\xb6rld\r\nsecond");
+
+	/* dragging doesn't encode anything */
+	term_sel_update(&term, SEL_REGULAR, (struct coord) { 0, 0 },
+			(struct coord) { 4, 0 });
+	term_sel_update(&term, SEL_REGULAR, (struct coord) { 0, 0 },
+			(struct coord) { 10, 0 });
+	check(!term.sel.clip);
+
+	clip = term_sel_text(&term);
+	check(clip && !strcmp(clip->data, "hello w\xc3\xb6rld"));
+	check(term_sel_text(&term) == clip);
+
+	/* someone's still sending it: a new one for the next, theirs stays */
+	held = clip_get(clip);
+	feed(&term, "\033[1;15H\033[K");
+	clip = term_sel_text(&term);
+	check(clip != held);
+	check(!strcmp(clip->data, "hello w\xc3\xb6rld"));
+	check(held->refs == 1 && !strcmp(held->data, "hello w\xc3\xb6rld"));
+	clip_put(held);
+
+	/* output over it ends it, but whoever owns it still has the text */
+	feed(&term, "\033[1;1HJ");
+	check(term.sel.type == SEL_NONE);
+	check(term_sel_text(&term) == clip);
+	check(!strcmp(clip->data, "hello w\xc3\xb6rld"));
+
+	term_free(&term);
+}
+
+/* A selection that no longer fits must not outlive the cells it was on */
+static void test_sel_resize(void)
+{
+	static const struct coord sizes[] = {
+		{ 40, 10 }, { 1, 1 }, { 80, 24 }, { 120, 40 },
+	};
+	struct st_term term = { 0 };
+	struct st_clip *clip;
+	unsigned type, i;
+
+	term_init(&term, 80, 24, 7, 0, 256, 100);
+
+	for (type = SEL_REGULAR; type <= SEL_RECTANGULAR; type++)
+		for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+			term_resize(&term, (struct coord) { 80, 24 });
+			fill(&term);
+
+			term_sel_update(&term, type, (struct coord) { 0, 0 },
+					(struct coord) { 79, 23 });
+			term_resize(&term, sizes[i]);
+
+			/* still the old text, and the selection is gone */
+			clip = term_sel_text(&term);
+			check(clip && clip->len == 80 * 24);
+			check(clip && !memcmp(clip->data, "abcdef", 6));
+			check(term.sel.type == SEL_NONE);
+
+			/* output afterwards can't bring it back */
+			fill(&term);
+			check(term_sel_text(&term) == clip);
+		}
+
+	term_free(&term);
+}
+
+/* Selections the scroll region clips are clipped to the screen, too */
+static void test_sel_scroll(void)
+{
+	struct st_term term = { 0 };
+	struct st_clip *clip;
+
+	term_init(&term, 10, 30, 7, 0, 256, 100);
+	fill(&term);
+
+	term_sel_update(&term, SEL_REGULAR, (struct coord) { 0, 2 },
+			(struct coord) { 9, 29 });
+	feed(&term, "\033[1;5r\033[5;1H\n");
+
+	/* rows 1 to 4 are left, the last one blank */
+	clip = term_sel_text(&term);
+	check(clip && clip->len == 3 * 10 + 1);
+
+	term_free(&term);
+}
+
+/* A character split across reads is still one character */
+static void test_utf8_split(void)
+{
+	struct st_term term = { 0 };
+	int fd[2];
+
+	term_init(&term, 80, 24, 7, 0, 256, 0);
+
+	feed(&term, "\xe4\xb8");
+	check(term.c.pos.x == 0);
+	feed(&term, "\xad");
+	check(term_line(&term, 0)[0].c == 0x4e2d);
+	check(!term_line(&term, 0)[1].c);
+	check(term.c.pos.x == 1);
+
+	/* the same through the pty side, a byte per read, 4 byte sequence */
+	if (pipe(fd))
+		edie("pipe failed");
+	fcntl(fd[0], F_SETFL, O_NONBLOCK);
+	term.cmdfd = fd[0];
+
+	check(write(fd[1], "\xf0", 1) == 1);
+	term_read(&term, 1000);
+	check(write(fd[1], "\x9f\x98", 2) == 2);
+	term_read(&term, 1000);
+	check(term.c.pos.x == 1);
+	check(write(fd[1], "\x80", 1) == 1);
+	term_read(&term, 1000);
+	check(term_line(&term, 0)[1].c == 0x1f600);
+	check(term.c.pos.x == 2);
+
+	close(fd[0]);
+	close(fd[1]);
+	term_free(&term);
+}
+
+int main(int argc, char *argv[])
+{
+	test_sel_text();
+	test_sel_resize();
+	test_sel_scroll();
+	test_utf8_split();
+
+	if (failed) {
+		fprintf(stderr, "%u checks failed\n", failed);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}